@@ -1,6 +1,6 @@
 QT -= gui
 
-CONFIG += c++11 console
+CONFIG += c++11 console thread
 CONFIG -= app_bundle
 
 # The following define makes your compiler emit warnings if you use
@@ -28,8 +28,35 @@ HEADERS += \
     allocator.hpp \
     expression.hpp \
     graph.hpp \
+    half.hpp \
     lstm.hpp \
     matrix.hpp \
-    mlp.hpp
+    mlp.hpp \
+    planner.hpp \
+    predictor.hpp \
+    profiler.hpp \
+    quantize.hpp \
+    random.hpp \
+    sparse.hpp \
+    staticmat.hpp \
+    threadpool.hpp
 
 #QMAKE_CXXFLAGS = -O3
+# per layer timers, see profiler.hpp
+#DEFINES += ML_PROFILE
+# packed VectorExpr evaluation (AVX, exp/tanh/sigmoid need AVX2), see VectorExpr.hpp
+#QMAKE_CXXFLAGS += -mavx2 -mfma
+
+# system cblas for gemm when one is installed, see matrix.hpp.
+# build with CONFIG+=no_cblas to keep the in-tree kernel
+!no_cblas {
+    packagesExist(openblas) {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += openblas
+        DEFINES += USE_CBLAS
+    } else: packagesExist(blis) {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += blis
+        DEFINES += USE_CBLAS
+    }
+}
@@ -1,9 +1,9 @@
 #ifndef VECTOR_HPP
 #define VECTOR_HPP
 #include <iostream>
-#include <random>
 #include <memory>
 #include "allocator.hpp"
+#include "random.hpp"
 
 
 template <typename T, template<typename> class TAllocator = Allocator>
@@ -230,31 +230,24 @@ public:
         std::cout<<std::endl;
         return;
     }
+    /* uniform in [0, N] for integers and [0, N) otherwise, from the ML::Random stream */
     void rand(int N)
     {
-        std::default_random_engine e;
-        std::uniform_int_distribution<int> r(0, N);
-        for (int i = 0; i < size_; i++) {
-            ptr[i] = r(e);
+        uint64_t offset = ML::Random::reserve(size_);
+        ML::Philox engine = ML::Random::engine();
+        for (size_t i = 0; i < size_; i++) {
+            ptr[i] = int(ML::Philox::toUnit(engine.at(offset + i)) * (N + 1));
         }
         return;
     }
     void rand(float N)
     {
-        std::default_random_engine e;
-        std::uniform_real_distribution<float> r(0, N);
-        for (int i = 0; i < size_; i++) {
-            ptr[i] = r(e);
-        }
+        ML::Random::engine().uniform(ML::Random::reserve(size_), ptr, size_, 0, N);
         return;
     }
     void rand(double N)
     {
-        std::default_random_engine e;
-        std::uniform_real_distribution<double> r(0, N);
-        for (int i = 0; i < size_; i++) {
-            ptr[i] = r(e);
-        }
+        ML::Random::engine().uniform(ML::Random::reserve(size_), ptr, size_, 0, N);
         return;
     }
     inline size_t size() const {return size_;}
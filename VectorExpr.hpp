@@ -4,11 +4,35 @@
 #include <iostream>
 #include <cmath>
 #include <type_traits>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 namespace VectorExpr {
 
 using T = double;
 
+/*
+    with AVX every node also evaluates a pack of lanes, load(i) is [i, i + PacketSize).
+    an assignment runs packs and finishes the tail with operator[]
+*/
+#ifdef __AVX__
+using Packet = __m256d;
+constexpr size_t PacketSize = 4;
+
+/* f on every lane, for functions without a packed form */
+template<typename F>
+inline Packet lanes(Packet x, F f)
+{
+    alignas(32) T a[PacketSize];
+    _mm256_store_pd(a, x);
+    for (size_t l = 0; l < PacketSize; l++) {
+        a[l] = f(a[l]);
+    }
+    return _mm256_load_pd(a);
+}
+#endif
+
 template <typename TExprImpl>
 class Expr
 {
@@ -26,8 +50,27 @@ public:
     Scalar(const T &s_):s(s_){}
     Scalar(const Scalar &r):s(r.s){}
     inline T operator[](size_t) const {return s;}
+#ifdef __AVX__
+    inline Packet load(size_t) const {return _mm256_set1_pd(s);}
+#endif
     inline size_t size() const {return 1;}
 };
+
+/* y[i] = expr[i] for i in [0, n) */
+template<typename TExpr>
+inline void assign(T *y, const TExpr &expr, size_t n)
+{
+    size_t i = 0;
+#ifdef __AVX__
+    for (; i + PacketSize <= n; i += PacketSize) {
+        _mm256_storeu_pd(y + i, expr.load(i));
+    }
+#endif
+    for (; i < n; i++) {
+        y[i] = expr[i];
+    }
+    return;
+}
 /* Vector */
 class Vector : public Expr<Vector>
 {
@@ -37,6 +80,9 @@ protected:
     size_t size_;
 public:
     inline T operator[](size_t i) const {return ptr[i];}
+#ifdef __AVX__
+    inline Packet load(size_t i) const {return _mm256_loadu_pd(ptr + i);}
+#endif
     inline T& at(size_t i) const {return ptr[i];}
     inline size_t size() const {return size_;}
     Vector():ptr(nullptr), size_(0){}
@@ -70,9 +116,7 @@ public:
         const TExpr& expr = r.impl();
         ptr = allocator.allocate(expr.size());
         size_ = expr.size();
-        for (size_t i = 0; i < size_; i++) {
-            ptr[i] = expr[i];
-        }
+        assign(ptr, expr, size_);
     }
     Vector& operator = (const Vector &r)
     {
@@ -106,12 +150,16 @@ public:
     Vector& operator = (const Expr<TExpr> &r)
     {
         const TExpr& expr = r.impl();
+        /* the expression may read this vector, element i is read before it is written */
+        if (size_ == expr.size()) {
+            assign(ptr, expr, size_);
+            return *this;
+        }
+        T *p = allocator.allocate(expr.size());
+        assign(p, expr, expr.size());
         allocator.deallocate(size_, ptr);
-        ptr = allocator.allocate(expr.size());
+        ptr = p;
         size_ = expr.size();
-        for (size_t i = 0; i < size_; i++) {
-            ptr[i] = expr[i];
-        }
         return *this;
     }
 
@@ -144,6 +192,9 @@ public:
     explicit BinaryOperator(const Expr<TLeft> &left_, const Expr<TRight> &right_):
         left(left_.impl()), right(right_.impl()){}
     inline T operator[](size_t i) const {return TOperator::apply(left[i], right[i]);}
+#ifdef __AVX__
+    inline Packet load(size_t i) const {return TOperator::apply(left.load(i), right.load(i));}
+#endif
     inline T& at(size_t i) const {return TOperator::apply(left[i], right[i]);}
     inline size_t size() const {return left.size();}
 protected:
@@ -156,6 +207,9 @@ class UnaryOperator : public Expr<UnaryOperator<TOperator, TRight> >
 public:
     explicit UnaryOperator(const Expr<TRight> &right_):right(right_.impl()){}
     inline T operator[](size_t i) const {return TOperator::apply(right[i]);}
+#ifdef __AVX__
+    inline Packet load(size_t i) const {return TOperator::apply(right.load(i));}
+#endif
     inline T& at(size_t i) const {return TOperator::apply(right[i]);}
     inline size_t size() const {return right.size();}
 protected:
@@ -165,46 +219,161 @@ protected:
 /* basic operation */
 struct Plus {
     inline static T apply(T x1, T x2) {return x1 + x2;};
+#ifdef __AVX__
+    inline static Packet apply(Packet x1, Packet x2) {return _mm256_add_pd(x1, x2);}
+#endif
 };
 
 struct Minus {
     inline static T apply(T x1, T x2) {return x1 - x2;};
+#ifdef __AVX__
+    inline static Packet apply(Packet x1, Packet x2) {return _mm256_sub_pd(x1, x2);}
+#endif
 };
 
 struct Multi {
     inline static T apply(T x1, T x2) {return x1 * x2;};
+#ifdef __AVX__
+    inline static Packet apply(Packet x1, Packet x2) {return _mm256_mul_pd(x1, x2);}
+#endif
 };
 
 struct Divide {
     inline static T apply(T x1, T x2) {return x1 / x2;};
+#ifdef __AVX__
+    inline static Packet apply(Packet x1, Packet x2) {return _mm256_div_pd(x1, x2);}
+#endif
 };
 
 struct Negative {
     inline static T apply(T x) {return -x;};
+#ifdef __AVX__
+    inline static Packet apply(Packet x) {return _mm256_xor_pd(x, _mm256_set1_pd(-0.0));}
+#endif
 };
 /* function */
 struct Pow {
     inline static T apply(T x, T n) {return pow(x, n);};
+#ifdef __AVX__
+    inline static Packet apply(Packet x, Packet n)
+    {
+        alignas(32) T a[PacketSize];
+        alignas(32) T b[PacketSize];
+        _mm256_store_pd(a, x);
+        _mm256_store_pd(b, n);
+        for (size_t l = 0; l < PacketSize; l++) {
+            a[l] = pow(a[l], b[l]);
+        }
+        return _mm256_load_pd(a);
+    }
+#endif
 };
 
 struct Sqrt {
     inline static T apply(T x) {return sqrt(x);};
+#ifdef __AVX__
+    inline static Packet apply(Packet x) {return _mm256_sqrt_pd(x);}
+#endif
 };
 
 struct Exp {
     inline static T apply(T x) {return exp(x);};
+#ifdef __AVX2__
+    /*
+        Cephes exp: x = n * ln2 + r with |r| <= ln2 / 2, exp(r) by a Pade form
+        and 2^n in two factors so n down to the subnormal range fits the exponent field.
+        within 2 ulp of std::exp
+    */
+    inline static Packet apply(Packet x)
+    {
+        const Packet maxLog = _mm256_set1_pd(709.782712893384);
+        const Packet minLog = _mm256_set1_pd(-745.1332191019411);
+        Packet xc = _mm256_min_pd(_mm256_max_pd(x, minLog), maxLog);
+        Packet n = _mm256_round_pd(_mm256_mul_pd(xc, _mm256_set1_pd(1.4426950408889634)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        Packet r = _mm256_sub_pd(xc, _mm256_mul_pd(n, _mm256_set1_pd(6.93145751953125E-1)));
+        r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(1.42860682030941723212E-6)));
+        Packet rr = _mm256_mul_pd(r, r);
+        Packet p = _mm256_set1_pd(1.26177193074810590878E-4);
+        p = _mm256_add_pd(_mm256_mul_pd(p, rr), _mm256_set1_pd(3.02994407707441961300E-2));
+        p = _mm256_add_pd(_mm256_mul_pd(p, rr), _mm256_set1_pd(9.99999999999999999910E-1));
+        p = _mm256_mul_pd(p, r);
+        Packet q = _mm256_set1_pd(3.00198505138664455042E-6);
+        q = _mm256_add_pd(_mm256_mul_pd(q, rr), _mm256_set1_pd(2.52448340349684104192E-3));
+        q = _mm256_add_pd(_mm256_mul_pd(q, rr), _mm256_set1_pd(2.27265548208155028766E-1));
+        q = _mm256_add_pd(_mm256_mul_pd(q, rr), _mm256_set1_pd(2.00000000000000000009E0));
+        Packet y = _mm256_div_pd(p, _mm256_sub_pd(q, p));
+        y = _mm256_add_pd(_mm256_set1_pd(1), _mm256_add_pd(y, y));
+        /* y * 2^n1 * 2^n2, n1 = n / 2 */
+        __m128i n32 = _mm256_cvtpd_epi32(n);
+        __m128i n1 = _mm_srai_epi32(n32, 1);
+        __m128i n2 = _mm_sub_epi32(n32, n1);
+        const __m256i bias = _mm256_set1_epi64x(1023);
+        Packet s1 = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(_mm256_cvtepi32_epi64(n1), bias), 52));
+        Packet s2 = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(_mm256_cvtepi32_epi64(n2), bias), 52));
+        y = _mm256_mul_pd(_mm256_mul_pd(y, s1), s2);
+        /* overflow, underflow and nan */
+        y = _mm256_blendv_pd(y, _mm256_set1_pd(HUGE_VAL), _mm256_cmp_pd(x, maxLog, _CMP_GT_OQ));
+        y = _mm256_blendv_pd(y, _mm256_setzero_pd(), _mm256_cmp_pd(x, minLog, _CMP_LT_OQ));
+        return _mm256_blendv_pd(y, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+    }
+#elif defined(__AVX__)
+    inline static Packet apply(Packet x) {return lanes(x, [](T v){return exp(v);});}
+#endif
 };
 
 struct Tanh {
     inline static T apply(T x) {return tanh(x);};
+#ifdef __AVX2__
+    /* Cephes tanh: a rational form below 0.625, 1 - 2 / (exp(2|x|) + 1) above, within 2 ulp */
+    inline static Packet apply(Packet x)
+    {
+        const Packet sign = _mm256_set1_pd(-0.0);
+        const Packet one = _mm256_set1_pd(1);
+        Packet a = _mm256_andnot_pd(sign, x);
+        Packet e = Exp::apply(_mm256_add_pd(a, a));
+        Packet large = _mm256_sub_pd(one, _mm256_div_pd(_mm256_set1_pd(2), _mm256_add_pd(e, one)));
+        large = _mm256_or_pd(large, _mm256_and_pd(sign, x));
+        Packet s = _mm256_mul_pd(x, x);
+        Packet p = _mm256_set1_pd(-9.64399179425052238628E-1);
+        p = _mm256_add_pd(_mm256_mul_pd(p, s), _mm256_set1_pd(-9.92877231001918586564E1));
+        p = _mm256_add_pd(_mm256_mul_pd(p, s), _mm256_set1_pd(-1.61468768441708447952E3));
+        Packet q = _mm256_add_pd(s, _mm256_set1_pd(1.12811678491632931402E2));
+        q = _mm256_add_pd(_mm256_mul_pd(q, s), _mm256_set1_pd(2.23548839060100448583E3));
+        q = _mm256_add_pd(_mm256_mul_pd(q, s), _mm256_set1_pd(4.84406305325125486048E3));
+        Packet small = _mm256_add_pd(x, _mm256_mul_pd(_mm256_mul_pd(x, s), _mm256_div_pd(p, q)));
+        return _mm256_blendv_pd(small, large, _mm256_cmp_pd(a, _mm256_set1_pd(0.625), _CMP_GT_OQ));
+    }
+#elif defined(__AVX__)
+    inline static Packet apply(Packet x) {return lanes(x, [](T v){return tanh(v);});}
+#endif
 };
 
 struct Sigmoid {
-    inline static T apply(T x) {return exp(x) / (1 + exp(x));};
+    /* exp only sees -|x|: no inf / inf for large x, and no early 0 below -709 */
+    inline static T apply(T x)
+    {
+        T e = exp(-std::fabs(x));
+        return x >= 0 ? 1 / (1 + e) : e / (1 + e);
+    }
+#ifdef __AVX__
+    /* within 3 ulp with the AVX2 exp */
+    inline static Packet apply(Packet x)
+    {
+        const Packet one = _mm256_set1_pd(1);
+        Packet e = Exp::apply(_mm256_or_pd(x, _mm256_set1_pd(-0.0)));
+        Packet numerator = _mm256_blendv_pd(one, e, _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ));
+        return _mm256_div_pd(numerator, _mm256_add_pd(one, e));
+    }
+#endif
 };
 
 struct Relu {
     inline static T apply(T x) {return x > 0 ? x : 0;};
+#ifdef __AVX__
+    /* max_pd returns the second operand for nan, as the scalar form */
+    inline static Packet apply(Packet x) {return _mm256_max_pd(x, _mm256_setzero_pd());}
+#endif
 };
 
 template<typename TLeft, typename TRight>
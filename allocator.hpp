@@ -2,6 +2,7 @@
 #define ALLOCATOR_HPP
 #include <map>
 #include <vector>
+#include <cstddef>
 
 template <typename T>
 class Allocator
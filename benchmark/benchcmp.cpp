@@ -0,0 +1,115 @@
+#include "benchmark.hpp"
+#include <map>
+
+/*
+    usage: benchcmp baseline.json current.json [--threshold=0.05] [--alpha=0.01]
+    a case regresses when its median time grows by more than threshold and
+    the Mann-Whitney U test rejects equal distributions at level alpha.
+    exit code: 0 ok, 1 regression, 2 bad input
+*/
+
+/* two sided p value of the Mann-Whitney U test, normal approximation with tie correction */
+double mannWhitney(const std::vector<double> &x, const std::vector<double> &y)
+{
+    double n1 = x.size();
+    double n2 = y.size();
+    double n = n1 + n2;
+    std::vector<std::pair<double, int> > all;
+    for (double v : x) {
+        all.push_back(std::make_pair(v, 0));
+    }
+    for (double v : y) {
+        all.push_back(std::make_pair(v, 1));
+    }
+    std::sort(all.begin(), all.end());
+    /* average ranks of ties */
+    double rankSum = 0;
+    double tieSum = 0;
+    for (std::size_t i = 0; i < all.size();) {
+        std::size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first) {
+            j++;
+        }
+        double rank = (i + 1 + j) / 2.0;
+        for (std::size_t k = i; k < j; k++) {
+            if (all[k].second == 0) {
+                rankSum += rank;
+            }
+        }
+        double t = j - i;
+        tieSum += t * t * t - t;
+        i = j;
+    }
+    double u = rankSum - n1 * (n1 + 1) / 2;
+    double mu = n1 * n2 / 2;
+    double sigma = std::sqrt(n1 * n2 / 12 * ((n + 1) - tieSum / (n * (n - 1))));
+    if (sigma == 0) {
+        return 1;
+    }
+    double d = std::fabs(u - mu) - 0.5;
+    double z = d > 0 ? d / sigma : 0;
+    return std::erfc(z / std::sqrt(2.0));
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> files;
+    double threshold = 0.05;
+    double alpha = 0.01;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        std::string value = arg.substr(arg.find('=') + 1);
+        if (arg.find("--threshold=") == 0) {
+            threshold = std::atof(value.c_str());
+        } else if (arg.find("--alpha=") == 0) {
+            alpha = std::atof(value.c_str());
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.size() != 2) {
+        std::cout<<"usage: benchcmp baseline.json current.json [--threshold=0.05] [--alpha=0.01]"<<std::endl;
+        return 2;
+    }
+    std::vector<Bench::Result> baseline;
+    std::vector<Bench::Result> current;
+    if (!Bench::load(files[0], baseline) || !Bench::load(files[1], current)) {
+        return 2;
+    }
+    std::map<std::string, const Bench::Result*> base;
+    for (auto &r : baseline) {
+        base[r.name] = &r;
+    }
+    int regressionNum = 0;
+    int improvementNum = 0;
+    std::printf("%-40s %12s %12s %9s %9s  %s\n", "case", "base(ns)", "current(ns)", "change", "p", "verdict");
+    for (auto &r : current) {
+        auto it = base.find(r.name);
+        if (it == base.end()) {
+            std::printf("%-40s %12s %12.1f %9s %9s  %s\n", r.name.c_str(), "-", r.median, "-", "-", "new");
+            continue;
+        }
+        const Bench::Result &b = *it->second;
+        double change = r.median / b.median - 1;
+        double p = mannWhitney(b.samples, r.samples);
+        const char* verdict = "same";
+        if (p < alpha && change > threshold) {
+            verdict = "REGRESSION";
+            regressionNum++;
+        } else if (p < alpha && change < -threshold) {
+            verdict = "improved";
+            improvementNum++;
+        } else if (std::fabs(change) > threshold) {
+            verdict = "noise";
+        }
+        std::printf("%-40s %12.1f %12.1f %+8.2f%% %9.4f  %s\n", r.name.c_str(),
+                    b.median, r.median, 100 * change, p, verdict);
+        base.erase(it);
+    }
+    for (auto &b : base) {
+        std::printf("%-40s %12.1f %12s %9s %9s  %s\n", b.first.c_str(), b.second->median, "-", "-", "-", "missing");
+    }
+    std::printf("regressions: %d improvements: %d (threshold %.1f%%, alpha %g)\n",
+                regressionNum, improvementNum, 100 * threshold, alpha);
+    return regressionNum > 0 ? 1 : 0;
+}
@@ -0,0 +1,12 @@
+QT -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = benchcmp
+
+SOURCES += \
+        benchcmp.cpp
+
+HEADERS += \
+    benchmark.hpp
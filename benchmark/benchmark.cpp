@@ -0,0 +1,342 @@
+#include "benchmark.hpp"
+#include "../mlp.hpp"
+#include "../lstm.hpp"
+#include "../Vector.hpp"
+#include "../VectorExpr.hpp"
+#include "../allocator.hpp"
+
+using namespace ML;
+
+/*
+    usage: benchmark [--filter=name] [--repetitions=n] [--warmup=n]
+                     [--min-time=seconds] [--json=result.json]
+    times are nanoseconds per call, compare two json files with benchcmp
+*/
+
+void bench_mat(Bench::Runner &runner)
+{
+    for (int n : {32, 64, 128, 256}) {
+        Mat<float> a(n, n, UNIFORM_RAND);
+        Mat<float> b(n, n, UNIFORM_RAND);
+        runner.run("mat/gemm/f32/" + std::to_string(n), [&]{
+            Mat<float> c = a * b;
+            Bench::keep(c);
+        });
+    }
+    for (int n : {64, 256}) {
+        Mat<double> a(n, n, UNIFORM_RAND);
+        Mat<double> b(n, n, UNIFORM_RAND);
+        runner.run("mat/gemm/f64/" + std::to_string(n), [&]{
+            Mat<double> c = a * b;
+            Bench::keep(c);
+        });
+    }
+    /* matrix vector, the shape of a layer forward pass */
+    Mat<float> w(256, 256, UNIFORM_RAND);
+    Mat<float> x(256, 1, UNIFORM_RAND);
+    runner.run("mat/gemv/f32/256", [&]{
+        Mat<float> y = w * x;
+        Bench::keep(y);
+    });
+    runner.run("mat/outer/f32/256", [&]{
+        Mat<float> y = x * x.Tr();
+        Bench::keep(y);
+    });
+    Mat<float> outer(256, 256);
+    runner.run("mat/outer_accumulate/f32/256", [&]{
+        accumulateOuter(outer, x, x);
+        Bench::keep(outer);
+    });
+    runner.run("mat/trmul/f32/256", [&]{
+        Mat<float> y = TrMul(w, x);
+        Bench::keep(y);
+    });
+    runner.run("mat/tr_then_mul/f32/256", [&]{
+        Mat<float> y = w.Tr() * x;
+        Bench::keep(y);
+    });
+    Mat<float> e(256, 1);
+    runner.run("mat/gemm_tn_inplace/f32/256", [&]{
+        gemm(1.0f, w, TRANSPOSE, x, NORMAL, 1.0f, e);
+        Bench::keep(e);
+    });
+    /* a 16 sample slice of a 256 sample batch */
+    Mat<float> batch(256, 256, UNIFORM_RAND);
+    Mat<float> slice(256, 16);
+    runner.run("mat/batch_slice_copy/f32/256x16", [&]{
+        Mat<float> xs = batch.subset(0, 64, 256, 16);
+        gemm(1.0f, w, NORMAL, xs, NORMAL, 0.0f, slice);
+        Bench::keep(slice);
+    });
+    runner.run("mat/batch_slice_view/f32/256x16", [&]{
+        gemm(1.0f, w.view(), NORMAL, batch.view(0, 64, 256, 16), NORMAL, 0.0f, slice.view());
+        Bench::keep(slice);
+    });
+    for (int n : {64, 512}) {
+        Mat<float> a(n, n, UNIFORM_RAND);
+        runner.run("mat/transpose/f32/" + std::to_string(n), [&]{
+            Mat<float> t = a.Tr();
+            Bench::keep(t);
+        });
+    }
+    Mat<float> a(256, 256, UNIFORM_RAND);
+    Mat<float> b(256, 256, UNIFORM_RAND);
+    runner.run("mat/add/f32/256", [&]{
+        Mat<float> c = a + b;
+        Bench::keep(c);
+    });
+    runner.run("mat/hadamard/f32/256", [&]{
+        Mat<float> c = a % b;
+        Bench::keep(c);
+    });
+    runner.run("mat/axpy_inplace/f32/256", [&]{
+        a += b * 0.5f;
+        Bench::keep(a);
+    });
+    runner.run("mat/sigmoid/f32/256", [&]{
+        Mat<float> c = Sigmoid<float>::_(b);
+        Bench::keep(c);
+    });
+    runner.run("mat/tanh/f32/256", [&]{
+        Mat<float> c = Tanh<float>::_(b);
+        Bench::keep(c);
+    });
+    runner.run("mat/relu/f32/256", [&]{
+        Mat<float> c = Relu<float>::_(b);
+        Bench::keep(c);
+    });
+    runner.run("mat/uniform_rand/f32/1024", [&]{
+        Mat<float> c(1024, 1024, UNIFORM_RAND);
+        Bench::keep(c);
+    });
+    Mat<float> big(1024, 1024);
+    runner.run("mat/zero/f32/1024", [&]{
+        big.zero();
+        Bench::keep(big);
+    });
+    runner.run("mat/exp/f32/1024", [&]{
+        Mat<float> c = EXP(big);
+        Bench::keep(c);
+    });
+    ThreadPool pool;
+    runner.run("mat/exp_parallel/f32/1024", [&]{
+        Mat<float> c = parallel_for_each(pool, big, [](float v){return std::exp(v);});
+        Bench::keep(c);
+    });
+    /* results are stored outside the lambda so the reductions can not be dropped */
+    float total = 0;
+    Pos pos;
+    runner.run("mat/sum/f32/256", [&]{
+        total = sum(a);
+        Bench::keep(total);
+    });
+    runner.run("mat/sum_kahan/f32/256", [&]{
+        total = sum(a, KAHAN);
+        Bench::keep(total);
+    });
+    runner.run("mat/norm2/f32/256", [&]{
+        total = norm2(a);
+        Bench::keep(total);
+    });
+    runner.run("mat/max/f32/256", [&]{
+        total = max(a);
+        Bench::keep(total);
+    });
+    runner.run("mat/argmax/f32/256", [&]{
+        pos = argmax(a);
+        Bench::keep(pos);
+    });
+    Mat<float> logits(1024, 1, UNIFORM_RAND);
+    runner.run("mat/softmax/f32/1024", [&]{
+        Mat<float> p = SOFTMAX(logits);
+        Bench::keep(p);
+    });
+    Mat<float> batchLogits(1024, 32, UNIFORM_RAND);
+    Mat<float> label(1024, 32);
+    for (int j = 0; j < 32; j++) {
+        label.data[j][j] = 1;
+    }
+    Mat<float> prob;
+    Mat<float> dx;
+    runner.run("mat/softmax_xent/f32/1024x32", [&]{
+        float loss = softmaxCrossEntropy(batchLogits, label, prob, dx);
+        Bench::keep(loss);
+    });
+    Mat<float> k1(16, 16, UNIFORM_RAND);
+    Mat<float> k2(16, 16, UNIFORM_RAND);
+    runner.run("mat/kronecker/f32/16x16", [&]{
+        Mat<float> k = Kronecker(k1, k2);
+        Bench::keep(k);
+    });
+    return;
+}
+
+void bench_allocator(Bench::Runner &runner)
+{
+    Allocator<double> allocator;
+    for (size_t n : {64, 4096}) {
+        runner.run("allocator/pool/" + std::to_string(n), [&]{
+            double *p = allocator.allocate(n);
+            Bench::keep(p);
+            allocator.deallocate(n, p);
+        });
+        runner.run("allocator/new/" + std::to_string(n), [&]{
+            double *p = new double[n];
+            Bench::keep(p);
+            delete [] p;
+        });
+    }
+    return;
+}
+
+void bench_vector(Bench::Runner &runner)
+{
+    const size_t N = 4096;
+    Vector<double> x1(N, 5);
+    Vector<double> x2(N, 7);
+    runner.run("vector/eager/4096", [&]{
+        Vector<double> x3 = x1 * 5 + x2 / 7 + 12;
+        Bench::keep(x3);
+    });
+    VectorExpr::Vector u(N, 5);
+    VectorExpr::Vector v(N, 7);
+    runner.run("vector/expr/4096", [&]{
+        VectorExpr::Vector z = u * 5 + v / 7 + 12;
+        Bench::keep(z);
+    });
+    VectorExpr::Vector z(N);
+    runner.run("vector/expr_inplace/4096", [&]{
+        z = u * 5 + v / 7 + 12;
+        Bench::keep(z);
+    });
+    runner.run("vector/expr_exp/4096", [&]{
+        z = VectorExpr::EXP(u * 0.1 - v);
+        Bench::keep(z);
+    });
+    runner.run("vector/expr_tanh/4096", [&]{
+        z = VectorExpr::TANH(u * 0.1 - v);
+        Bench::keep(z);
+    });
+    runner.run("vector/expr_sigmoid/4096", [&]{
+        z = VectorExpr::SIGMOID(u * 0.1 - v);
+        Bench::keep(z);
+    });
+    return;
+}
+
+void bench_graph(Bench::Runner &runner)
+{
+    for (int n : {1000, 10000}) {
+        /* random DAG, every vertex has up to 4 edges to later vertices */
+        Graph<int> graph;
+        for (int i = 0; i < n; i++) {
+            graph.insertVertex(i, "v" + std::to_string(i));
+        }
+        srand(1);
+        for (int i = 0; i + 1 < n; i++) {
+            int edgeNum = 1 + rand() % 4;
+            for (int k = 0; k < edgeNum; k++) {
+                graph.insertEdge(i, i + 1 + rand() % std::min(64, n - i - 1));
+            }
+        }
+        runner.run("graph/toposort/" + std::to_string(n), [&]{
+            graph.toposort();
+            Bench::keep(graph.topologySequence);
+        });
+        runner.run("graph/find_vertex/" + std::to_string(n), [&]{
+            int i = graph.findVertex("v" + std::to_string(n / 2));
+            Bench::keep(i);
+        });
+    }
+    return;
+}
+
+template<template<typename> class OptimizeF>
+MLP<float, Sigmoid, OptimizeF> makeNet()
+{
+    using Net = MLP<float, Sigmoid, OptimizeF>;
+    return Net(typename Net::LayerParams {
+                   {INPUT, MSE, 128, 64, "input"},
+                   {HIDDEN, MSE, 128, 1, "hidden1"},
+                   {HIDDEN, MSE, 128, 1, "hidden2"},
+                   {OUTPUT, MSE, 10, 1, "output"}
+               },
+               typename Net::GraphParams {
+                   {"input", "hidden1"},
+                   {"hidden1", "hidden2"},
+                   {"input", "hidden2"},
+                   {"hidden2", "output"}
+               });
+}
+
+void bench_mlp(Bench::Runner &runner)
+{
+    using Net = MLP<float, Sigmoid, Adam>;
+    Net net = makeNet<Adam>();
+    Net::Input x;
+    x["input"] = Mat<float>(64, 1, UNIFORM_RAND);
+    Mat<float> y(10, 1, UNIFORM_RAND);
+    runner.run("mlp/train_step/adam", [&]{
+        net.feedForward(x);
+        net.gradient(x, y);
+        net.optimize(0.001);
+    });
+    auto sgdNet = makeNet<SGD>();
+    runner.run("mlp/train_step/sgd", [&]{
+        sgdNet.feedForward(x);
+        sgdNet.gradient(x, y);
+        sgdNet.optimize(0.001);
+    });
+    Net::Flat flat = net.clone();
+    runner.run("mlp/infer/1", [&]{
+        flat.feedForward(x);
+        Bench::keep(flat.getObject(flat.outputIndex()).O);
+    });
+    Net::Input batch;
+    batch["input"] = Mat<float>(64, 32, UNIFORM_RAND);
+    Net::State state;
+    runner.run("mlp/infer/batch32", [&]{
+        flat.feedForward(batch, state);
+        Bench::keep(state);
+    });
+    return;
+}
+
+template<bool fixed>
+void bench_lstm(Bench::Runner &runner, const std::string &name)
+{
+    using Lstm = LSTM<8, 32, 1, fixed>;
+    Lstm lstm;
+    typename Lstm::Input x(8, 1, UNIFORM_RAND);
+    runner.run("lstm/" + name + "/step", [&]{
+        Bench::keep(lstm.feedForward(x));
+    });
+    std::vector<typename Lstm::Input> seq(16, x);
+    std::vector<typename Lstm::Output> target(16, typename Lstm::Output(1, 1));
+    runner.run("lstm/" + name + "/bptt16", [&]{
+        lstm.forward(seq);
+        lstm.gradient(seq, target);
+        lstm.SGD(0.001);
+    });
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    srand(0);
+    Random::seed(0);
+    Bench::Runner runner;
+    std::string json = runner.parse(argc, argv);
+    runner.header();
+    bench_mat(runner);
+    bench_allocator(runner);
+    bench_vector(runner);
+    bench_graph(runner);
+    bench_mlp(runner);
+    bench_lstm<false>(runner, "dynamic");
+    bench_lstm<true>(runner, "fixed");
+    if (!json.empty()) {
+        runner.save(json);
+    }
+    return 0;
+}
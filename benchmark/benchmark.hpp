@@ -0,0 +1,353 @@
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cctype>
+#include <iterator>
+#include <atomic>
+
+namespace Bench {
+
+/*
+    keep a result alive so the optimizer can not drop the work: the asm takes
+    the address of x and clobbers memory, so x has to be computed and stored.
+    other compilers get a volatile sink and a compiler fence
+*/
+template<typename T>
+inline void keep(const T &x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "g"(&x) : "memory");
+#else
+    static const volatile void* sink;
+    sink = &x;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+template<typename T>
+inline void keep(T *x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "g"(x) : "memory");
+#else
+    static T* volatile sink;
+    sink = x;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+struct Result
+{
+    std::string name;
+    /* calls per sample */
+    int iterations;
+    /* nanoseconds per call */
+    std::vector<double> samples;
+    double mean;
+    double median;
+    double stddev;
+    double min;
+    double max;
+    void statistics()
+    {
+        std::vector<double> x(samples);
+        std::sort(x.begin(), x.end());
+        int n = x.size();
+        mean = std::accumulate(x.begin(), x.end(), 0.0) / n;
+        median = n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+        double s = 0;
+        for (double v : x) {
+            s += (v - mean) * (v - mean);
+        }
+        stddev = n > 1 ? std::sqrt(s / (n - 1)) : 0;
+        min = x.front();
+        max = x.back();
+        return;
+    }
+};
+
+/* minimal json reader, enough for the result files written by Runner::save */
+class Json
+{
+public:
+    enum Type {
+        NONE = 0,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+public:
+    Type type;
+    double number;
+    std::string text;
+    std::vector<Json> items;
+    std::vector<std::string> keys;
+public:
+    Json():type(NONE), number(0){}
+    const Json* find(const std::string &key) const
+    {
+        for (std::size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] == key) {
+                return &items[i];
+            }
+        }
+        return nullptr;
+    }
+    static bool parse(const std::string &s, Json &value)
+    {
+        std::size_t pos = 0;
+        return parse(s, pos, value);
+    }
+protected:
+    static void skip(const std::string &s, std::size_t &pos)
+    {
+        while (pos < s.size() && std::isspace((unsigned char)s[pos])) {
+            pos++;
+        }
+        return;
+    }
+    static bool parseString(const std::string &s, std::size_t &pos, std::string &text)
+    {
+        pos++;
+        while (pos < s.size() && s[pos] != '"') {
+            if (s[pos] == '\\' && pos + 1 < s.size()) {
+                pos++;
+            }
+            text.push_back(s[pos++]);
+        }
+        pos++;
+        return pos <= s.size();
+    }
+    static bool parse(const std::string &s, std::size_t &pos, Json &value)
+    {
+        skip(s, pos);
+        if (pos >= s.size()) {
+            return false;
+        }
+        char c = s[pos];
+        if (c == '{' || c == '[') {
+            value.type = c == '{' ? OBJECT : ARRAY;
+            char close = c == '{' ? '}' : ']';
+            pos++;
+            skip(s, pos);
+            if (pos < s.size() && s[pos] == close) {
+                pos++;
+                return true;
+            }
+            while (pos < s.size()) {
+                skip(s, pos);
+                if (value.type == OBJECT) {
+                    std::string key;
+                    if (s[pos] != '"' || !parseString(s, pos, key)) {
+                        return false;
+                    }
+                    skip(s, pos);
+                    if (pos >= s.size() || s[pos] != ':') {
+                        return false;
+                    }
+                    pos++;
+                    value.keys.push_back(key);
+                }
+                value.items.push_back(Json());
+                if (!parse(s, pos, value.items.back())) {
+                    return false;
+                }
+                skip(s, pos);
+                if (pos < s.size() && s[pos] == ',') {
+                    pos++;
+                } else if (pos < s.size() && s[pos] == close) {
+                    pos++;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+            return false;
+        }
+        if (c == '"') {
+            value.type = STRING;
+            return parseString(s, pos, value.text);
+        }
+        /* number, true, false and null are read as numbers */
+        std::size_t begin = pos;
+        while (pos < s.size() && s[pos] != ',' && s[pos] != '}' && s[pos] != ']' &&
+               !std::isspace((unsigned char)s[pos])) {
+            pos++;
+        }
+        value.type = NUMBER;
+        value.number = std::atof(s.substr(begin, pos - begin).c_str());
+        return pos > begin;
+    }
+};
+
+/* results of a json file written by Runner::save */
+inline bool load(const std::string &fileName, std::vector<Result> &results)
+{
+    std::ifstream file(fileName);
+    if (!file.is_open()) {
+        std::cout<<"failed to open "<<fileName<<std::endl;
+        return false;
+    }
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    Json root;
+    if (!Json::parse(content, root)) {
+        std::cout<<"invalid json: "<<fileName<<std::endl;
+        return false;
+    }
+    const Json* benchmarks = root.find("benchmarks");
+    if (benchmarks == nullptr || benchmarks->type != Json::ARRAY) {
+        std::cout<<"no benchmarks in "<<fileName<<std::endl;
+        return false;
+    }
+    for (const Json &b : benchmarks->items) {
+        const Json* name = b.find("name");
+        const Json* iterations = b.find("iterations");
+        const Json* samples = b.find("samples");
+        if (name == nullptr || samples == nullptr || samples->items.empty()) {
+            continue;
+        }
+        Result result;
+        result.name = name->text;
+        result.iterations = iterations == nullptr ? 0 : int(iterations->number);
+        for (const Json &x : samples->items) {
+            result.samples.push_back(x.number);
+        }
+        result.statistics();
+        results.push_back(result);
+    }
+    return true;
+}
+
+/*
+    each case is calibrated so one sample lasts at least minTime seconds,
+    then warmed up and measured repetitions times
+*/
+class Runner
+{
+public:
+    using Clock = std::chrono::steady_clock;
+public:
+    int warmup;
+    int repetitions;
+    double minTime;
+    std::string filter;
+    std::vector<Result> results;
+public:
+    Runner():warmup(2), repetitions(15), minTime(0.01){}
+
+    /* --filter=name --repetitions=n --warmup=n --min-time=seconds --json=file */
+    std::string parse(int argc, char** argv)
+    {
+        std::string json;
+        for (int i = 1; i < argc; i++) {
+            std::string arg(argv[i]);
+            std::string value = arg.substr(arg.find('=') + 1);
+            if (arg.find("--filter=") == 0) {
+                filter = value;
+            } else if (arg.find("--repetitions=") == 0) {
+                repetitions = std::max(2, std::atoi(value.c_str()));
+            } else if (arg.find("--warmup=") == 0) {
+                warmup = std::max(0, std::atoi(value.c_str()));
+            } else if (arg.find("--min-time=") == 0) {
+                minTime = std::atof(value.c_str());
+            } else if (arg.find("--json=") == 0) {
+                json = value;
+            } else {
+                std::cout<<"unknown argument: "<<arg<<std::endl;
+            }
+        }
+        return json;
+    }
+
+    template<typename F>
+    void run(const std::string &name, F func)
+    {
+        if (!filter.empty() && name.find(filter) == std::string::npos) {
+            return;
+        }
+        int iterations = 1;
+        while (true) {
+            double t = measure(func, iterations);
+            if (t >= minTime || iterations >= (1 << 26)) {
+                break;
+            }
+            int scale = t > 0 ? int(std::ceil(1.2 * minTime / t)) : 10;
+            iterations *= std::min(10, std::max(2, scale));
+        }
+        for (int i = 0; i < warmup; i++) {
+            measure(func, iterations);
+        }
+        Result result;
+        result.name = name;
+        result.iterations = iterations;
+        for (int i = 0; i < repetitions; i++) {
+            result.samples.push_back(measure(func, iterations) * 1e9 / iterations);
+        }
+        result.statistics();
+        std::printf("%-40s %12.1f %12.1f %8.2f%% %10d\n", name.c_str(),
+                    result.median, result.mean, 100 * result.stddev / result.mean, iterations);
+        std::fflush(stdout);
+        results.push_back(result);
+        return;
+    }
+
+    void header() const
+    {
+        std::printf("%-40s %12s %12s %9s %10s\n", "case", "median(ns)", "mean(ns)", "cv", "iterations");
+        return;
+    }
+
+    void save(const std::string &fileName) const
+    {
+        std::ofstream file(fileName);
+        if (!file.is_open()) {
+            std::cout<<"failed to open "<<fileName<<std::endl;
+            return;
+        }
+        file.precision(10);
+        std::time_t now = std::time(nullptr);
+        char date[32];
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+        file<<"{\n\"context\": {\"date\": \""<<date<<"\", \"repetitions\": "<<repetitions
+            <<", \"warmup\": "<<warmup<<", \"min_time\": "<<minTime<<"},\n";
+        file<<"\"benchmarks\": [\n";
+        for (std::size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            file<<"{\"name\": \""<<r.name<<"\", \"iterations\": "<<r.iterations
+                <<", \"mean\": "<<r.mean<<", \"median\": "<<r.median
+                <<", \"stddev\": "<<r.stddev<<", \"min\": "<<r.min<<", \"max\": "<<r.max
+                <<", \"samples\": [";
+            for (std::size_t j = 0; j < r.samples.size(); j++) {
+                file<<r.samples[j]<<(j + 1 < r.samples.size() ? ", " : "");
+            }
+            file<<"]}"<<(i + 1 < results.size() ? ",\n" : "\n");
+        }
+        file<<"]\n}\n";
+        return;
+    }
+protected:
+    /* seconds for iterations calls */
+    template<typename F>
+    double measure(F &func, int iterations)
+    {
+        Clock::time_point begin = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            func();
+        }
+        return std::chrono::duration<double>(Clock::now() - begin).count();
+    }
+};
+
+}
+#endif // BENCHMARK_HPP
@@ -0,0 +1,31 @@
+QT -= gui
+
+CONFIG += c++11 console thread
+CONFIG -= app_bundle
+CONFIG += release
+
+TARGET = benchmark
+INCLUDEPATH += ..
+
+SOURCES += \
+        benchmark.cpp
+
+HEADERS += \
+    benchmark.hpp
+
+QMAKE_CXXFLAGS_RELEASE -= -O2
+QMAKE_CXXFLAGS_RELEASE += -O3
+
+# system cblas for gemm when one is installed, see matrix.hpp.
+# build with CONFIG+=no_cblas to keep the in-tree kernel
+!no_cblas {
+    packagesExist(openblas) {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += openblas
+        DEFINES += USE_CBLAS
+    } else: packagesExist(blis) {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += blis
+        DEFINES += USE_CBLAS
+    }
+}
@@ -4,7 +4,8 @@
 #include <vector>
 #include <queue>
 #include <stack>
-#include <map>
+#include <unordered_map>
+#include <string>
 
 class Edge
 {
@@ -56,22 +57,37 @@ public:
     std::vector<Edge> edges;
     std::vector<int> topologySequence;
     std::vector<int> traversalSequence;
-    std::map<int, std::vector<int> > previous;
-    std::map<int, std::vector<int> > nexts;
+    /* vertices of a level depend only on lower levels */
+    std::vector<std::vector<int> > levels;
+    std::vector<std::vector<int> > previous;
+    std::vector<std::vector<int> > nexts;
+    /* forward and reverse adjacency, maintained on insertEdge */
+    std::vector<std::vector<int> > outAdj;
+    std::vector<std::vector<int> > inAdj;
+    /* outSlot[from][k]: position of from in inAdj[outAdj[from][k]] */
+    std::vector<std::vector<int> > outSlot;
+    /* vertex name to index */
+    std::unordered_map<std::string, int> vertexIndex;
 public:
     Graph(){}
     ~Graph(){}
-    inline bool isDAG(){return (vertexs.size() == topologySequence.size());}
-    inline bool isEmpty(){return vertexs.size() < 2;}
+    inline bool isDAG() const {return (vertexs.size() == topologySequence.size());}
+    inline bool isEmpty() const {return vertexs.size() < 2;}
     inline T& getObject(int index){return vertexs.at(index).object;}
+    inline const T& getObject(int index) const {return vertexs.at(index).object;}
     void copy(const Graph<T> &graph)
     {
         vertexs = graph.vertexs;
         edges = graph.edges;
         topologySequence = graph.topologySequence;
         traversalSequence = graph.traversalSequence;
+        levels = graph.levels;
         previous = graph.previous;
         nexts = graph.nexts;
+        outAdj = graph.outAdj;
+        inAdj = graph.inAdj;
+        outSlot = graph.outSlot;
+        vertexIndex = graph.vertexIndex;
     }
     Graph(const Graph<T> &graph)
     {
@@ -87,21 +103,20 @@ public:
         return *this;
     }
 
-    int findVertex(const std::string &name)
+    int findVertex(const std::string &name) const
     {
-        int index = -1;
-        for (int i = 0; i < vertexs.size(); i++) {
-            if (vertexs[i].name == name) {
-                index = i;
-                break;
-            }
-        }
-        return index;
+        auto it = vertexIndex.find(name);
+        return it == vertexIndex.end() ? -1 : it->second;
     }
 
     void insertVertex(const T& obj, const std::string &vertexName)
     {
+        /* the first vertex of a name keeps it */
+        vertexIndex.insert(std::make_pair(vertexName, int(vertexs.size())));
         vertexs.push_back(Vertex<T>(obj, vertexName));
+        outAdj.push_back(std::vector<int>());
+        inAdj.push_back(std::vector<int>());
+        outSlot.push_back(std::vector<int>());
         return;
     }
 
@@ -115,6 +130,9 @@ public:
             return;
         }
         edges.push_back(Edge(from, to, weight));
+        outAdj[from].push_back(to);
+        outSlot[from].push_back(inAdj[to].size());
+        inAdj[to].push_back(from);
         vertexs[to].indegree++;
         return;
     }
@@ -130,50 +148,29 @@ public:
             std::cout<<"invalid vertex name"<<std::endl;
             return;
         }
-        if (from >= vertexs.size() || to >= vertexs.size()) {
-            std::cout<<"index out of range"<<std::endl;
-            return;
-        }
-        edges.push_back(Edge(from, to, weight));
-        vertexs[to].indegree++;
-        return;
+        return insertEdge(from, to, weight);
     }
 
     std::vector<int> findNext(int index)
     {
-        std::vector<int> nextIndex;
-        for (auto x : edges) {
-            if (x.from == index) {
-                nextIndex.push_back(x.to);
-            }
-        }
-        return nextIndex;
+        return outAdj.at(index);
     }
 
     std::vector<int> findPrevious(int index)
     {
-        std::vector<int> preIndex;
-        for (auto x : edges) {
-            if (x.to == index) {
-                preIndex.push_back(x.from);
-            }
-        }
-        //std::cout<<preIndex.size()<<std::endl;
-        return preIndex;
+        return inAdj.at(index);
     }
 
     bool generate()
     {
-        for (int i = 0; i < vertexs.size(); i++) {
-            nexts[i] = findNext(i);
-            previous[i] = findPrevious(i);
-        }
+        nexts = outAdj;
+        previous = inAdj;
         return toposort();
     }
 
     void BFS(int index)
     {
-        if (index > vertexs.size()) {
+        if (index >= vertexs.size()) {
             return;
         }
         /* clear */
@@ -186,12 +183,12 @@ public:
         while (!indexQueue.empty()) {
             int index = indexQueue.front();
             indexQueue.pop();
-            for (auto it = edges.begin(); it != edges.end(); it++) {
-                if (it->from == index && vertexs[it->to].visited == false) {
+            for (int to : outAdj[index]) {
+                if (vertexs[to].visited == false) {
                     /* visit */
-                    vertexs[it->to].visited = true;
-                    indexQueue.push(it->to);
-                    traversalSequence.push_back(it->to);
+                    vertexs[to].visited = true;
+                    indexQueue.push(to);
+                    traversalSequence.push_back(to);
                 }
             }
         }
@@ -200,30 +197,30 @@ public:
 
     void DFS(int index)
     {
-        if (index > vertexs.size()) {
+        if (index >= vertexs.size()) {
             return;
         }
         /* clear */
         clearVisit();
-        /* visit */
+        /* visit, each vertex resumes its adjacency list where it left off */
+        std::vector<int> cursor(vertexs.size(), 0);
         std::stack<int> indexStack;
         vertexs[index].visited = true;
         traversalSequence.push_back(index);
         indexStack.push(index);
-        indexStack.push(index);
         while (!indexStack.empty()) {
-            int index = indexStack.top();
-            indexStack.pop();
-            for (auto it = edges.begin(); it != edges.end(); it++) {
-                if (it->from == index && vertexs[it->to].visited == false) {
-                    /* visit */
-                    vertexs[it->to].visited = true;
-                    traversalSequence.push_back(it->to);
-                    indexStack.push(it->to);
-                    /* transit */
-                    index = it->to;
-                    it = edges.begin();
-                }
+            int current = indexStack.top();
+            if (cursor[current] == outAdj[current].size()) {
+                indexStack.pop();
+                continue;
+            }
+            int to = outAdj[current][cursor[current]++];
+            if (vertexs[to].visited == false) {
+                /* visit */
+                vertexs[to].visited = true;
+                traversalSequence.push_back(to);
+                /* transit */
+                indexStack.push(to);
             }
         }
         return;
@@ -233,11 +230,9 @@ public:
     {
         traversalSequence.push_back(index);
         vertexs[index].visited = true;
-        for (auto it = edges.begin(); it != edges.end(); it++) {
-            if (it->from == index) {
-                if (vertexs[it->to].visited == false) {
-                    RDFS(it->to);
-                }
+        for (int to : outAdj[index]) {
+            if (vertexs[to].visited == false) {
+                RDFS(to);
             }
         }
         return;
@@ -262,22 +257,32 @@ public:
         while (!indegreeQueue.empty()) {
             int index = indegreeQueue.front();
             indegreeQueue.pop();
-            for (auto it = edges.begin(); it != edges.end(); it++) {
-                if (it->from == index) {
-                    indegrees[it->to]--;
-                    if (indegrees[it->to] == 0) {
-                        indegreeQueue.push(it->to);
-                        topologySequence.push_back(it->to);
-                    }
+            for (int to : outAdj[index]) {
+                indegrees[to]--;
+                if (indegrees[to] == 0) {
+                    indegreeQueue.push(to);
+                    topologySequence.push_back(to);
                 }
             }
         }
+        /* level */
+        levels.clear();
+        std::vector<int> level(vertexs.size(), 0);
+        for (int index : topologySequence) {
+            for (int from : inAdj[index]) {
+                level[index] = level[from] + 1 > level[index] ? level[from] + 1 : level[index];
+            }
+            if (std::size_t(level[index]) >= levels.size()) {
+                levels.resize(level[index] + 1);
+            }
+            levels[level[index]].push_back(index);
+        }
         return topologySequence.size() == vertexs.size();
     }
 
     void clearVisit()
     {
-        for (auto x : vertexs) {
+        for (auto &x : vertexs) {
             x.visited = false;
         }
         traversalSequence.clear();
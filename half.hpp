@@ -0,0 +1,201 @@
+#ifndef HALF_HPP
+#define HALF_HPP
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+#include "matrix.hpp"
+
+namespace ML {
+
+/*
+    16 bit storage types, arithmetic is done in float:
+    bfloat16: 8 bit exponent, 7 bit mantissa, same range as float
+    float16: ieee 754 half, 5 bit exponent, 10 bit mantissa
+*/
+class bfloat16
+{
+public:
+    uint16_t bits;
+public:
+    bfloat16():bits(0){}
+    bfloat16(float x):bits(fromFloat(x)){}
+    inline operator float() const {return toFloat(bits);}
+    inline bfloat16& operator += (float x){bits = fromFloat(toFloat(bits) + x); return *this;}
+    inline bfloat16& operator -= (float x){bits = fromFloat(toFloat(bits) - x); return *this;}
+    inline bfloat16& operator *= (float x){bits = fromFloat(toFloat(bits) * x); return *this;}
+    inline bfloat16& operator /= (float x){bits = fromFloat(toFloat(bits) / x); return *this;}
+
+    /* round to nearest even */
+    static inline uint16_t fromFloat(float x)
+    {
+        uint32_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        if ((u & 0x7fffffff) > 0x7f800000) {
+            /* quiet nan */
+            return uint16_t((u >> 16) | 0x40);
+        }
+        u += 0x7fff + ((u >> 16) & 1);
+        return uint16_t(u >> 16);
+    }
+    static inline float toFloat(uint16_t b)
+    {
+        uint32_t u = uint32_t(b) << 16;
+        float x;
+        std::memcpy(&x, &u, sizeof(x));
+        return x;
+    }
+};
+
+class float16
+{
+public:
+    uint16_t bits;
+public:
+    float16():bits(0){}
+    float16(float x):bits(fromFloat(x)){}
+    inline operator float() const {return toFloat(bits);}
+    inline float16& operator += (float x){bits = fromFloat(toFloat(bits) + x); return *this;}
+    inline float16& operator -= (float x){bits = fromFloat(toFloat(bits) - x); return *this;}
+    inline float16& operator *= (float x){bits = fromFloat(toFloat(bits) * x); return *this;}
+    inline float16& operator /= (float x){bits = fromFloat(toFloat(bits) / x); return *this;}
+
+    /* round to nearest even, overflow goes to inf */
+    static inline uint16_t fromFloat(float x)
+    {
+#ifdef __F16C__
+        return _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+        uint32_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        uint32_t sign = (u >> 16) & 0x8000;
+        u &= 0x7fffffff;
+        if (u >= 0x47800000) {
+            /* inf or nan */
+            return uint16_t(sign | (u > 0x7f800000 ? 0x7e00 : 0x7c00));
+        }
+        if (u < 0x38800000) {
+            /* subnormal, let the fpu round by adding 0.5 */
+            float f;
+            std::memcpy(&f, &u, sizeof(f));
+            f += 0.5f;
+            std::memcpy(&u, &f, sizeof(u));
+            return uint16_t(sign | (u - 0x3f000000));
+        }
+        uint32_t odd = (u >> 13) & 1;
+        /* rebias exponent from 127 to 15 and round */
+        u += 0xc8000fff + odd;
+        return uint16_t(sign | (u >> 13));
+#endif
+    }
+    static inline float toFloat(uint16_t h)
+    {
+#ifdef __F16C__
+        return _cvtsh_ss(h);
+#else
+        const uint32_t shiftedExp = 0x7c00 << 13;
+        uint32_t u = uint32_t(h & 0x7fff) << 13;
+        uint32_t exp = shiftedExp & u;
+        u += (127 - 15) << 23;
+        float x;
+        if (exp == shiftedExp) {
+            /* inf or nan */
+            u += (128 - 16) << 23;
+        } else if (exp == 0) {
+            /* subnormal, renormalize */
+            const uint32_t magicBits = 113 << 23;
+            float magic;
+            std::memcpy(&magic, &magicBits, sizeof(magic));
+            u += 1 << 23;
+            std::memcpy(&x, &u, sizeof(x));
+            x -= magic;
+            std::memcpy(&u, &x, sizeof(u));
+        }
+        u |= uint32_t(h & 0x8000) << 16;
+        std::memcpy(&x, &u, sizeof(x));
+        return x;
+#endif
+    }
+};
+
+template<>
+struct Accumulate<bfloat16>
+{
+    using type = float;
+};
+
+template<>
+struct Accumulate<float16>
+{
+    using type = float;
+};
+
+inline std::istream& operator >> (std::istream &in, bfloat16 &x)
+{
+    float f;
+    in >> f;
+    x = bfloat16(f);
+    return in;
+}
+
+inline std::istream& operator >> (std::istream &in, float16 &x)
+{
+    float f;
+    in >> f;
+    x = float16(f);
+    return in;
+}
+
+/* bulk conversion, plain loops over bits so the compiler can vectorize them */
+inline void convert(const float *x, bfloat16 *y, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        y[i].bits = bfloat16::fromFloat(x[i]);
+    }
+    return;
+}
+
+inline void convert(const bfloat16 *x, float *y, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        y[i] = bfloat16::toFloat(x[i].bits);
+    }
+    return;
+}
+
+inline void convert(const float *x, float16 *y, size_t n)
+{
+    size_t i = 0;
+#ifdef __F16C__
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), h);
+    }
+#endif
+    for (; i < n; i++) {
+        y[i].bits = float16::fromFloat(x[i]);
+    }
+    return;
+}
+
+inline void convert(const float16 *x, float *y, size_t n)
+{
+    size_t i = 0;
+#ifdef __F16C__
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(h));
+    }
+#endif
+    for (; i < n; i++) {
+        y[i] = float16::toFloat(x[i].bits);
+    }
+    return;
+}
+
+using Matbf16 = Mat<bfloat16>;
+using Matf16 = Mat<float16>;
+}
+#endif // HALF_HPP
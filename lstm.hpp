@@ -1,51 +1,73 @@
 #ifndef LSTM_HPP
 #define LSTM_HPP
 #include "matrix.hpp"
+#include "staticmat.hpp"
+#include "profiler.hpp"
 namespace ML {
 using T = double;
-template <int inputDim, int hiddenDim, int outputDim>
+
+/* storage of lstm matrices: runtime sized Mat, or inline StaticMat when fixed */
+template <int rows, int cols, bool fixed>
+struct MatOf
+{
+    using type = Mat<T>;
+};
+
+template <int rows, int cols>
+struct MatOf<rows, cols, true>
+{
+    using type = StaticMat<T, rows, cols>;
+};
+
+template <int inputDim, int hiddenDim, int outputDim, bool fixed = false>
 class CellParam
 {
+public:
+    using Wx = typename MatOf<hiddenDim, inputDim, fixed>::type;
+    using Wh = typename MatOf<hiddenDim, hiddenDim, fixed>::type;
+    using Bh = typename MatOf<hiddenDim, 1, fixed>::type;
+    using Wy = typename MatOf<outputDim, hiddenDim, fixed>::type;
+    using By = typename MatOf<outputDim, 1, fixed>::type;
 public:
     /* forget gate */
-    Mat<T> Wf;
-    Mat<T> Uf;
-    Mat<T> Bf;
+    Wx Wf;
+    Wh Uf;
+    Bh Bf;
     /* input gate */
-    Mat<T> Wi;
-    Mat<T> Ui;
-    Mat<T> Bi;
-    Mat<T> Wg;
-    Mat<T> Ug;
-    Mat<T> Bg;
+    Wx Wi;
+    Wh Ui;
+    Bh Bi;
+    Wx Wg;
+    Wh Ug;
+    Bh Bg;
     /* output gate */
-    Mat<T> Wo;
-    Mat<T> Uo;
-    Mat<T> Bo;
+    Wx Wo;
+    Wh Uo;
+    Bh Bo;
     /* output */
-    Mat<T> Wp;
-    Mat<T> Bp;
+    Wy Wp;
+    By Bp;
 public:
     CellParam()
     {
         /* forget gate */
-        Wf = Mat<T>(hiddenDim, inputDim);
-        Uf = Mat<T>(hiddenDim, hiddenDim);
-        Bf = Mat<T>(hiddenDim, 1);
+        Wf = Wx(hiddenDim, inputDim);
+        Uf = Wh(hiddenDim, hiddenDim);
+        Bf = Bh(hiddenDim, 1);
         /* input gate */
-        Wi = Mat<T>(hiddenDim, inputDim);
-        Ui = Mat<T>(hiddenDim, hiddenDim);
-        Bi = Mat<T>(hiddenDim, 1);
-        Wg = Mat<T>(hiddenDim, inputDim);
-        Ug = Mat<T>(hiddenDim, hiddenDim);
-        Bg = Mat<T>(hiddenDim, 1);
+        Wi = Wx(hiddenDim, inputDim);
+        Ui = Wh(hiddenDim, hiddenDim);
+        Bi = Bh(hiddenDim, 1);
+        Wg = Wx(hiddenDim, inputDim);
+        Ug = Wh(hiddenDim, hiddenDim);
+        Bg = Bh(hiddenDim, 1);
         /* output gate */
-        Wo = Mat<T>(hiddenDim, inputDim);
-        Uo = Mat<T>(hiddenDim, hiddenDim);
-        Bo = Mat<T>(hiddenDim, 1);
+        Wo = Wx(hiddenDim, inputDim);
+        Uo = Wh(hiddenDim, hiddenDim);
+        Bo = Bh(hiddenDim, 1);
         /* output */
-        Wp = Mat<T>(outputDim, hiddenDim);
-        Bp = Mat<T>(outputDim, 1);
+        Wp = Wy(outputDim, hiddenDim);
+        Bp = By(outputDim, 1);
     }
     void zero()
     {
@@ -61,6 +83,35 @@ public:
         Wo.zero();
         Uo.zero();
         Bo.zero();
+        Wp.zero();
+        Bp.zero();
+    }
+    /* squared norm of all matrices together */
+    T squaredNorm() const
+    {
+        return sumSquares(Wf) + sumSquares(Uf) + sumSquares(Bf) +
+                sumSquares(Wi) + sumSquares(Ui) + sumSquares(Bi) +
+                sumSquares(Wg) + sumSquares(Ug) + sumSquares(Bg) +
+                sumSquares(Wo) + sumSquares(Uo) + sumSquares(Bo) +
+                sumSquares(Wp) + sumSquares(Bp);
+    }
+    void scale(T x)
+    {
+        Wf *= x;
+        Uf *= x;
+        Bf *= x;
+        Wi *= x;
+        Ui *= x;
+        Bi *= x;
+        Wg *= x;
+        Ug *= x;
+        Bg *= x;
+        Wo *= x;
+        Uo *= x;
+        Bo *= x;
+        Wp *= x;
+        Bp *= x;
+        return;
     }
     void random()
     {
@@ -79,33 +130,36 @@ public:
     }
 };
 
-template <int hiddenDim, int outputDim>
+template <int hiddenDim, int outputDim, bool fixed = false>
 class CellState
 {
+public:
+    using Bh = typename MatOf<hiddenDim, 1, fixed>::type;
+    using By = typename MatOf<outputDim, 1, fixed>::type;
 public:
     /* forget gate */
-    Mat<T> f;
+    Bh f;
     /* input gate */
-    Mat<T> i;
-    Mat<T> g;
+    Bh i;
+    Bh g;
     /* output gate */
-    Mat<T> o;
+    Bh o;
     /* cell state */
-    Mat<T> c;
+    Bh c;
     /* hiddien output */
-    Mat<T> h;
+    Bh h;
     /* output */
-    Mat<T> y;
+    By y;
 public:
     CellState()
     {
-        f = Mat<T>(hiddenDim, 1);
-        i = Mat<T>(hiddenDim, 1);
-        g = Mat<T>(hiddenDim, 1);
-        o = Mat<T>(hiddenDim, 1);
-        c = Mat<T>(hiddenDim, 1);
-        h = Mat<T>(hiddenDim, 1);
-        y = Mat<T>(outputDim, 1);
+        f = Bh(hiddenDim, 1);
+        i = Bh(hiddenDim, 1);
+        g = Bh(hiddenDim, 1);
+        o = Bh(hiddenDim, 1);
+        c = Bh(hiddenDim, 1);
+        h = Bh(hiddenDim, 1);
+        y = By(outputDim, 1);
     }
 
     CellState(const CellState &state):
@@ -138,12 +192,15 @@ public:
     }
 };
 
-template <int inputDim, int hiddenDim, int outputDim>
+/* fixed = true keeps every matrix inline, for small models */
+template <int inputDim, int hiddenDim, int outputDim, bool fixed = false>
 class LSTM
 {
 public:
-    using Param = CellParam<inputDim, hiddenDim, outputDim>;
-    using State = CellState<hiddenDim, outputDim>;
+    using Param = CellParam<inputDim, hiddenDim, outputDim, fixed>;
+    using State = CellState<hiddenDim, outputDim, fixed>;
+    using Input = typename MatOf<inputDim, 1, fixed>::type;
+    using Output = typename MatOf<outputDim, 1, fixed>::type;
 public:
      Param P;
      Param dP;
@@ -158,7 +215,7 @@ public:
         P.random();
     }
 
-    Mat<T>& feedForward(const Mat<T> &x)
+    Output& feedForward(const Input &x)
     {
         /*
                                                             y
@@ -187,22 +244,33 @@ public:
             h' = o*tanh(c')
             y = sigmoid(W*h' + b)
         */
-        /* input gate */
-        state.i = Sigmoid<T>::_(P.Wi * x + P.Ui * state.h + P.Bi);
-        /* forget gate */
-        state.f = Sigmoid<T>::_(P.Wf * x + P.Uf * state.h + P.Bf);
-        /* output gate */
-        state.o = Sigmoid<T>::_(P.Wo * x + P.Uo * state.h + P.Bo);
-        state.g = Tanh<T>::_(P.Wg * x + P.Ug * state.h + P.Bg);
-        /* cell state */
-        state.c = state.f % state.c +  state.i % state.g;
-        state.h = state.o % Tanh<T>::_(state.c);
-        /* predict */
-        state.y = Sigmoid<T>::_(P.Wp * state.h + P.Bp);
+        {
+            ML_PROFILE_SCOPE("lstm", "gates", 8.0 * hiddenDim * (inputDim + hiddenDim),
+                             sizeof(T) * 4.0 * hiddenDim * (inputDim + hiddenDim));
+            /* input gate */
+            state.i = Sigmoid<T>::_(P.Wi * x + P.Ui * state.h + P.Bi);
+            /* forget gate */
+            state.f = Sigmoid<T>::_(P.Wf * x + P.Uf * state.h + P.Bf);
+            /* output gate */
+            state.o = Sigmoid<T>::_(P.Wo * x + P.Uo * state.h + P.Bo);
+            state.g = Tanh<T>::_(P.Wg * x + P.Ug * state.h + P.Bg);
+        }
+        {
+            ML_PROFILE_SCOPE("lstm", "cell", 5.0 * hiddenDim, sizeof(T) * 6.0 * hiddenDim);
+            /* cell state */
+            state.c = state.f % state.c +  state.i % state.g;
+            state.h = state.o % Tanh<T>::_(state.c);
+        }
+        {
+            ML_PROFILE_SCOPE("lstm", "predict", 2.0 * outputDim * hiddenDim,
+                             sizeof(T) * outputDim * hiddenDim);
+            /* predict */
+            state.y = Sigmoid<T>::_(P.Wp * state.h + P.Bp);
+        }
         return state.y;
     }
 
-    void forward(const std::vector<Mat<T> > &seq)
+    void forward(const std::vector<Input> &seq)
     {
         state.clear();
         states.push_back(state);
@@ -213,19 +281,22 @@ public:
         return;
     }
 
-    void gradient(const std::vector<Mat<T> > &x, const std::vector<Mat<T> > &y)
+    void gradient(const std::vector<Input> &x, const std::vector<Output> &y)
     {
         delta.clear();
         delta_.clear();
         for (int t = states.size() - 2; t >= 1; t--) {
+            /* error and gradient of every weight */
+            ML_PROFILE_SCOPE("lstm", "bptt", 4 * (4.0 * hiddenDim * (inputDim + hiddenDim) + outputDim * hiddenDim),
+                             2 * sizeof(T) * (4.0 * hiddenDim * (inputDim + hiddenDim) + outputDim * hiddenDim));
             /* loss */
             delta.y = (states[t].y - y[t]) * 2;
             /* backward */
-            delta.h += P.Wp.Tr() * delta.y;
-            delta.h += P.Ui.Tr() * delta_.i;
-            delta.h += P.Ug.Tr() * delta_.g;
-            delta.h += P.Uf.Tr() * delta_.f;
-            delta.h += P.Uo.Tr() * delta_.o;
+            gemm<TRANSPOSE, NORMAL>(T(1), P.Wp, delta.y, T(1), delta.h);
+            gemm<TRANSPOSE, NORMAL>(T(1), P.Ui, delta_.i, T(1), delta.h);
+            gemm<TRANSPOSE, NORMAL>(T(1), P.Ug, delta_.g, T(1), delta.h);
+            gemm<TRANSPOSE, NORMAL>(T(1), P.Uf, delta_.f, T(1), delta.h);
+            gemm<TRANSPOSE, NORMAL>(T(1), P.Uo, delta_.o, T(1), delta.h);
 
             delta.o = delta.h % Tanh<T>::_(states[t].c) % Sigmoid<T>::d(states[t].o);
             delta.c = delta.h % states[t].o % Tanh<T>::d(states[t].c) +
@@ -235,23 +306,24 @@ public:
             delta.g = delta.c % states[t].i % Tanh<T>::d(states[t].g);
 
             /* gradient */
-            dP.Wi += delta.i * x[t].Tr();
-            dP.Wg += delta.g * x[t].Tr();
-            dP.Wf += delta.f * x[t].Tr();
-            dP.Wo += delta.o * x[t].Tr();
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.i, x[t], T(1), dP.Wi);
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.g, x[t], T(1), dP.Wg);
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.f, x[t], T(1), dP.Wf);
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.o, x[t], T(1), dP.Wo);
 
-            dP.Ui += delta.i * states[t - 1].h.Tr();
-            dP.Ug += delta.g * states[t - 1].h.Tr();
-            dP.Uf += delta.f * states[t - 1].h.Tr();
-            dP.Uo += delta.o * states[t - 1].h.Tr();
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.i, states[t - 1].h, T(1), dP.Ui);
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.g, states[t - 1].h, T(1), dP.Ug);
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.f, states[t - 1].h, T(1), dP.Uf);
+            gemm<NORMAL, TRANSPOSE>(T(1), delta.o, states[t - 1].h, T(1), dP.Uo);
 
             dP.Bi += delta.i;
             dP.Bg += delta.g;
             dP.Bf += delta.f;
             dP.Bo += delta.o;
 
-            dP.Wp += (delta.y % Sigmoid<T>::d(states[t].y)) * states[t].h.Tr();
-            dP.Bp += delta.y % Sigmoid<T>::d(states[t].y);
+            Output dy = delta.y % Sigmoid<T>::d(states[t].y);
+            gemm<NORMAL, TRANSPOSE>(T(1), dy, states[t].h, T(1), dP.Wp);
+            dP.Bp += dy;
             /* save */
             delta_ = delta;
         }
@@ -259,8 +331,23 @@ public:
         return;
     }
 
+    /*
+        rescale the accumulated gradient to a global norm of at most maxNorm
+        (Pascanu et al. 2013), between gradient and the optimizer.
+        returns the norm before clipping
+    */
+    T clip(double maxNorm)
+    {
+        T norm = std::sqrt(dP.squaredNorm());
+        if (norm > maxNorm) {
+            dP.scale(maxNorm / norm);
+        }
+        return norm;
+    }
+
     void SGD(double learningRate)
     {
+        ML_PROFILE_SCOPE("lstm", "sgd");
         P.Wf -= dP.Wf * learningRate;
         P.Uf -= dP.Uf * learningRate;
         P.Bf -= dP.Bf * learningRate;
@@ -285,6 +372,7 @@ public:
 
     void RMSProp(double rho, double learningRate)
     {
+        ML_PROFILE_SCOPE("lstm", "rmsprop");
         Sp.Wi = Sp.Wi * rho + (dP.Wi % dP.Wi) * (1 - rho);
         Sp.Wg = Sp.Wg * rho + (dP.Wg % dP.Wg) * (1 - rho);
         Sp.Wf = Sp.Wf * rho + (dP.Wf % dP.Wf) * (1 - rho);
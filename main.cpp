@@ -3,7 +3,17 @@
 #include "expression.hpp"
 #include "Vector.hpp"
 #include "VectorExpr.hpp"
+#include "predictor.hpp"
+#include "quantize.hpp"
+#include "half.hpp"
 #include <chrono>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <limits>
+#include <algorithm>
 
 using namespace ML;
 
@@ -109,7 +119,7 @@ void test_xor()
     y[3][0][0] = 0;
     for (int i = 0; i < 10000; i++) {
         for (int j = 0; j < 4; j++) {
-            int k = rand() % 4;
+            int k = Random::uniform(4);
             bp.feedForward(x[k]);
             bp.gradient(x[k], y[k]);
         }
@@ -195,8 +205,8 @@ void test_lstm()
     std::vector<Mat<double> > target;
     for (int i = 0; i < 1000; i++) {
         Mat<double> p(2, 1);
-        double x = double(rand() % 1000) / 1000;
-        double y = double(rand() % 1000) / 1000;
+        double x = Random::unit();
+        double y = Random::unit();
         double z = zeta(x, y);
         p[0][0] = x;
         p[0][1] = y;
@@ -208,7 +218,7 @@ void test_lstm()
     auto sample = [&](std::vector<Mat<double> > &batchData,
             std::vector<Mat<double> > &batchTarget, int batchSize){
         for (int i = 0; i < batchSize; i++) {
-            int k = rand() % data.size();
+            int k = Random::uniform(data.size());
             batchData.push_back(data[k]);
             batchTarget.push_back(target[k]);
         }
@@ -219,12 +229,13 @@ void test_lstm()
         sample(batchData, batchTarget, 8);
         lstm.forward(batchData);
         lstm.gradient(batchData, batchTarget);
+        lstm.clip(5);
         lstm.RMSProp(0.9, 0.001);
     }
     for (int i = 0; i < 5; i++) {
         Mat<double> p(2, 1);
-        double x = double(rand() % 1000) / 1000;
-        double y = double(rand() % 1000) / 1000;
+        double x = Random::unit();
+        double y = Random::unit();
         double z = zeta(x, y);
         p[0][0] = x;
         p[0][1] = y;
@@ -234,9 +245,1281 @@ void test_lstm()
     }
     return;
 }
+void test_batch_predict()
+{
+    using BPNN = MLP<double, Sigmoid, Adam>;
+    BPNN bp(BPNN::LayerParams {
+                {INPUT, MSE, 8, 4, "input"},
+                {HIDDEN, MSE, 8, 1, "hidden"},
+                {OUTPUT, MSE, 2, 1, "output"}
+            },
+            BPNN::GraphParams {
+                {"input", "hidden"},
+                {"hidden", "output"}
+            });
+    BPNN::Flat net = bp.clone();
+    Predictor<BPNN::Flat> predictor(net);
+    Batcher<BPNN::Flat> batcher(net, 32, std::chrono::microseconds(500));
+    /* load generator */
+    const int threadNum = 8;
+    const int requestNum = 200;
+    std::vector<std::thread> clients;
+    std::vector<int> errors(threadNum, 0);
+    for (int t = 0; t < threadNum; t++) {
+        clients.push_back(std::thread([&, t]() {
+            for (int i = 0; i < requestNum; i++) {
+                BPNN::Flat::Input x;
+                x["input"] = Mat<double>(4, 1, UNIFORM_RAND);
+                Mat<double> y = batcher.submit(x).get();
+                Mat<double> y0 = predictor(x);
+                if (ML::max(for_each(y - y0, static_cast<double(*)(double)>(fabs))) > 1e-9) {
+                    errors[t]++;
+                }
+            }
+        }));
+    }
+    for (auto &client : clients) {
+        client.join();
+    }
+    int errorNum = 0;
+    for (int e : errors) {
+        errorNum += e;
+    }
+    std::cout<<"requests: "<<threadNum * requestNum<<" mismatch: "<<errorNum
+            <<" average batch: "<<batcher.averageBatchSize()<<std::endl;
+    /* malformed requests fail alone, the good ones of the same batch are answered */
+    Batcher<BPNN::Flat> slowBatcher(net, 32, std::chrono::microseconds(20000));
+    std::vector<BPNN::Flat::Input> inputs(6);
+    for (auto &x : inputs) {
+        x["input"] = Mat<double>(4, 1, UNIFORM_RAND);
+    }
+    inputs[1]["input"].create(3, 1);
+    inputs[3].clear();
+    inputs[3]["other"] = Mat<double>(4, 1, UNIFORM_RAND);
+    inputs[4]["input"].create(4, 2);
+    std::vector<std::future<Mat<double> > > results;
+    for (auto &x : inputs) {
+        results.push_back(slowBatcher.submit(x));
+    }
+    bool isolated = true;
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        bool bad = i == 1 || i == 3 || i == 4;
+        try {
+            Mat<double> y = results[i].get();
+            isolated = isolated && !bad && ML::max(for_each(y - predictor(inputs[i]), static_cast<double(*)(double)>(fabs))) < 1e-9;
+        } catch (const std::invalid_argument &) {
+            isolated = isolated && bad;
+        }
+    }
+    std::cout<<"malformed requests"<<(isolated ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+
+void test_quantize()
+{
+    using BPNN = MLP<float, Sigmoid, Adam>;
+    BPNN bp(BPNN::LayerParams {
+                {INPUT, MSE, 64, 32, "input"},
+                {HIDDEN, MSE, 64, 1, "hidden"},
+                {OUTPUT, CROSS_ENTROPY, 10, 1, "output"}
+            },
+            BPNN::GraphParams {
+                {"input", "hidden"},
+                {"hidden", "output"}
+            });
+    BPNN::Flat net = bp.clone();
+    BPNN::InputVec x(256);
+    for (auto &xi : x) {
+        xi["input"] = Mat<float>(32, 1, UNIFORM_RAND);
+    }
+    /* calibrate with the first half, evaluate with the second half */
+    BPNN::InputVec calibration(x.begin(), x.begin() + 128);
+    BPNN::InputVec samples(x.begin() + 128, x.end());
+    QuantizedMLP<BPNN::Flat> qnet(net, calibration);
+    qnet.compare(net, samples).show();
+    return;
+}
+
+void test_gemm()
+{
+    /* gemm (system blas when built with USE_CBLAS) against a naive triple loop */
+    const int shapes[][3] = {{3, 5, 4}, {64, 64, 1}, {128, 96, 80}};
+    for (auto &shape : shapes) {
+        int m = shape[0];
+        int p = shape[1];
+        int n = shape[2];
+        for (int opA = NORMAL; opA <= TRANSPOSE; opA++) {
+            for (int opB = NORMAL; opB <= TRANSPOSE; opB++) {
+                Mat<double> A = opA == NORMAL ? Mat<double>(m, p, UNIFORM_RAND) : Mat<double>(p, m, UNIFORM_RAND);
+                Mat<double> B = opB == NORMAL ? Mat<double>(p, n, UNIFORM_RAND) : Mat<double>(n, p, UNIFORM_RAND);
+                Mat<double> C(m, n, UNIFORM_RAND);
+                Mat<double> expect(C);
+                gemm(0.5, A, Operation(opA), B, Operation(opB), 2.0, C);
+                for (int i = 0; i < m; i++) {
+                    for (int j = 0; j < n; j++) {
+                        double c = 0;
+                        for (int k = 0; k < p; k++) {
+                            double a = opA == NORMAL ? A[i][k] : A[k][i];
+                            double b = opB == NORMAL ? B[k][j] : B[j][k];
+                            c += a * b;
+                        }
+                        expect[i][j] = 0.5 * c + 2.0 * expect[i][j];
+                    }
+                }
+                double error = max(for_each(C - expect, [](double x){return std::fabs(x);}));
+                std::cout<<"gemm "<<m<<"x"<<p<<"x"<<n<<" op "<<opA<<opB
+                         <<" max error: "<<error<<(error < 1e-9 ? " ok" : " FAILED")<<std::endl;
+            }
+        }
+    }
+    return;
+}
+double maxError(const Mat<double> &x, const Mat<double> &y)
+{
+    return max(for_each(x - y, [](double e){return std::fabs(e);}));
+}
+
+void test_staticmat()
+{
+    /* every gemm form of StaticMat against Mat gemm on the same numbers */
+    StaticMat<double, 4, 3> A(4, 3, UNIFORM_RAND);
+    StaticMat<double, 3, 5> B(3, 5, UNIFORM_RAND);
+    StaticMat<double, 4, 5> Bt(4, 5, UNIFORM_RAND);
+    StaticMat<double, 5, 3> C(5, 3, UNIFORM_RAND);
+    StaticMat<double, 4, 5> y1(4, 5, UNIFORM_RAND);
+    StaticMat<double, 3, 5> y2;
+    StaticMat<double, 4, 5> y3(4, 5, UNIFORM_RAND);
+    Mat<double> expect1 = y1.toMat();
+    Mat<double> expect2(3, 5);
+    Mat<double> expect3 = y3.toMat();
+    gemm<NORMAL, NORMAL>(0.5, A, B, 2.0, y1);
+    gemm(0.5, A.toMat(), NORMAL, B.toMat(), NORMAL, 2.0, expect1);
+    y2 = TrMul(A, Bt);
+    gemm(1.0, A.toMat(), TRANSPOSE, Bt.toMat(), NORMAL, 0.0, expect2);
+    accumulateOuter(y3, A, C);
+    gemm(1.0, A.toMat(), NORMAL, C.toMat(), TRANSPOSE, 1.0, expect3);
+    double gemmError = std::max(maxError(y1.toMat(), expect1), maxError((A * B).toMat(), A.toMat() * B.toMat()));
+    std::cout<<"static gemm error: "<<gemmError<<(gemmError < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    double trMulError = maxError(y2.toMat(), expect2);
+    std::cout<<"static TrMul error: "<<trMulError<<(trMulError < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    double outerError = maxError(y3.toMat(), expect3);
+    std::cout<<"static accumulateOuter error: "<<outerError<<(outerError < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    /* fixed and runtime lstm draw the same weights from the same seed, so they must agree */
+    Random::seed(7);
+    LSTM<2, 4, 1> lstm;
+    Random::seed(7);
+    LSTM<2, 4, 1, true> fixedLstm;
+    std::vector<Mat<double> > x;
+    std::vector<Mat<double> > y;
+    std::vector<StaticMat<double, 2, 1> > fixedX;
+    std::vector<StaticMat<double, 1, 1> > fixedY;
+    for (int i = 0; i < 8; i++) {
+        Mat<double> p(2, 1, UNIFORM_RAND);
+        Mat<double> q(1, 1, UNIFORM_RAND);
+        x.push_back(p);
+        y.push_back(q);
+        fixedX.push_back(StaticMat<double, 2, 1>(p));
+        fixedY.push_back(StaticMat<double, 1, 1>(q));
+    }
+    double lstmError = 0;
+    for (int step = 0; step < 3; step++) {
+        lstm.forward(x);
+        fixedLstm.forward(fixedX);
+        lstm.gradient(x, y);
+        fixedLstm.gradient(fixedX, fixedY);
+        lstm.SGD(0.1);
+        fixedLstm.SGD(0.1);
+    }
+    for (int i = 0; i < 8; i++) {
+        lstmError = std::max(lstmError, maxError(lstm.feedForward(x[i]), fixedLstm.feedForward(fixedX[i]).toMat()));
+    }
+    std::cout<<"fixed lstm error: "<<lstmError<<(lstmError < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+/* the graph of test_DAG: 4 inputs, 3 hidden layers in 2 levels, 1 output */
+void buildGraph(MLP<double, Sigmoid, Adam> &mlp)
+{
+    mlp.addLayer(INPUT, MSE, 4, 4, "input1");
+    mlp.addLayer(INPUT, MSE, 4, 4, "input2");
+    mlp.addLayer(INPUT, MSE, 4, 4, "input3");
+    mlp.addLayer(INPUT, MSE, 4, 4, "input4");
+    mlp.addLayer(HIDDEN, MSE, 8, "hidden1");
+    mlp.addLayer(HIDDEN, MSE, 8, "hidden2");
+    mlp.addLayer(HIDDEN, MSE, 8, "hidden3");
+    mlp.addLayer(OUTPUT, MSE, 4, "output");
+    mlp.connectLayer("input1", "hidden1");
+    mlp.connectLayer("input2", "hidden1");
+    mlp.connectLayer("input3", "hidden2");
+    mlp.connectLayer("input4", "hidden2");
+    mlp.connectLayer("input2", "hidden3");
+    mlp.connectLayer("input3", "hidden3");
+    mlp.connectLayer("hidden1", "hidden3");
+    mlp.connectLayer("hidden2", "hidden3");
+    mlp.connectLayer("hidden3", "output");
+    mlp.generate();
+    return;
+}
+
+MLP<double, Sigmoid, Adam>::Input graphInput(int batchSize)
+{
+    MLP<double, Sigmoid, Adam>::Input x;
+    x["input1"] = Mat<double>(4, batchSize, UNIFORM_RAND);
+    x["input2"] = Mat<double>(4, batchSize, UNIFORM_RAND);
+    x["input3"] = Mat<double>(4, batchSize, UNIFORM_RAND);
+    x["input4"] = Mat<double>(4, batchSize, UNIFORM_RAND);
+    return x;
+}
+
+void test_levels()
+{
+    MLP<double, Sigmoid, Adam> mlp;
+    buildGraph(mlp);
+    /* every vertex is in exactly one level, after all of its predecessors */
+    std::vector<int> levelOf(mlp.vertexs.size(), -1);
+    bool valid = mlp.levels.size() == 4;
+    for (std::size_t l = 0; l < mlp.levels.size(); l++) {
+        for (int v : mlp.levels[l]) {
+            valid = valid && levelOf[v] == -1;
+            levelOf[v] = l;
+        }
+    }
+    for (std::size_t v = 0; v < mlp.vertexs.size(); v++) {
+        valid = valid && levelOf[v] != -1;
+        for (int from : mlp.previous[v]) {
+            valid = valid && levelOf[from] < levelOf[v];
+        }
+    }
+    std::cout<<"levels: "<<mlp.levels.size()<<(valid ? " ok" : " FAILED")<<std::endl;
+    /* training by level on a pool gives the same weights as the sequential loops */
+    MLP<double, Sigmoid, Adam> parallelMlp(mlp);
+    ThreadPool pool(4);
+    double error = 0;
+    for (int step = 0; step < 5; step++) {
+        MLP<double, Sigmoid, Adam>::Input x = graphInput(1);
+        Mat<double> y(4, 1, UNIFORM_RAND);
+        mlp.feedForward(x);
+        mlp.gradient(x, y);
+        mlp.optimize(0.01);
+        parallelMlp.feedForward(x, pool);
+        parallelMlp.gradient(x, y, pool);
+        parallelMlp.optimize(0.01, pool);
+    }
+    for (std::size_t v = 0; v < mlp.vertexs.size(); v++) {
+        auto &layer = mlp.vertexs[v].object;
+        auto &parallelLayer = parallelMlp.vertexs[v].object;
+        for (std::size_t k = 0; k < layer.W.size(); k++) {
+            error = std::max(error, maxError(layer.W[k], parallelLayer.W[k]));
+        }
+        error = std::max(error, maxError(layer.O, parallelLayer.O));
+    }
+    std::cout<<"parallel training error: "<<error<<(error == 0 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_pack()
+{
+    MLP<double, Sigmoid, Adam> mlp;
+    buildGraph(mlp);
+    MLP<double, Sigmoid, Adam> packedMlp(mlp);
+    packedMlp.pack();
+    /* only hidden1, hidden2 and hidden3 have several predecessors */
+    int packedNum = 0;
+    for (auto &v : packedMlp.vertexs) {
+        packedNum += v.object.isPacked();
+    }
+    std::cout<<"packed layers: "<<packedNum<<(packedNum == 3 ? " ok" : " FAILED")<<std::endl;
+    /* one gemm over the stacked input trains like the per edge products */
+    double error = 0;
+    for (int step = 0; step < 5; step++) {
+        MLP<double, Sigmoid, Adam>::Input x = graphInput(1);
+        Mat<double> y(4, 1, UNIFORM_RAND);
+        mlp.feedForward(x);
+        mlp.gradient(x, y);
+        mlp.optimize(0.01);
+        packedMlp.feedForward(x);
+        packedMlp.gradient(x, y);
+        packedMlp.optimize(0.01);
+        error = std::max(error, maxError(mlp.vertexs[mlp.outputIndex()].object.O,
+                                         packedMlp.vertexs[packedMlp.outputIndex()].object.O));
+    }
+    for (std::size_t v = 0; v < mlp.vertexs.size(); v++) {
+        auto &layer = mlp.vertexs[v].object;
+        auto &packedLayer = packedMlp.vertexs[v].object;
+        for (std::size_t k = 0; k < layer.W.size(); k++) {
+            error = std::max(error, maxError(layer.W[k], packedLayer.W[k]));
+        }
+    }
+    std::cout<<"packed training error: "<<error<<(error < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+/* tensors alive at the same step never share memory or a slot */
+bool isValidPlan(const MemoryPlan &plan)
+{
+    bool valid = plan.peakSize >= plan.lowerBound() && plan.peakSize <= plan.totalSize();
+    for (std::size_t i = 0; i < plan.tensors.size(); i++) {
+        for (std::size_t j = i + 1; j < plan.tensors.size(); j++) {
+            const MemoryPlan::Tensor &a = plan.tensors[i];
+            const MemoryPlan::Tensor &b = plan.tensors[j];
+            if (!a.overlap(b)) {
+                continue;
+            }
+            bool disjoint = a.offset + a.size <= b.offset || b.offset + b.size <= a.offset;
+            valid = valid && disjoint && a.slot != b.slot;
+        }
+    }
+    return valid;
+}
+
+void test_plan()
+{
+    MLP<double, Sigmoid, Adam> mlp;
+    buildGraph(mlp);
+    MemoryPlan trainPlan = mlp.plan(8, true);
+    std::cout<<"training plan peak: "<<trainPlan.peakSize<<" without reuse: "<<trainPlan.totalSize()
+             <<(isValidPlan(trainPlan) ? " ok" : " FAILED")<<std::endl;
+    /* the planned forward reuses buffers and computes the same output */
+    MemoryPlan inferPlan = mlp.plan(8, false);
+    MLP<double, Sigmoid, Adam>::Input x = graphInput(8);
+    MLP<double, Sigmoid, Adam>::State O;
+    MLP<double, Sigmoid, Adam>::State plannedO;
+    mlp.feedForward(x, O);
+    mlp.feedForward(x, plannedO, inferPlan);
+    int output = mlp.outputIndex();
+    double error = maxError(O[output], plannedO[inferPlan.slotOf(output)]);
+    bool reused = inferPlan.slotNum < int(mlp.vertexs.size());
+    std::cout<<"inference plan slots: "<<inferPlan.slotNum<<" error: "<<error
+             <<(isValidPlan(inferPlan) && reused && error == 0 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_profiler()
+{
+    /* the cost arguments are evaluated only when the profiler is compiled in */
+    Profiler &profiler = Profiler::instance();
+    profiler.clear();
+    int evaluated = 0;
+    {
+        ML_PROFILE_SCOPE("test", "scope", double(++evaluated), 0);
+    }
+    bool compiled = evaluated == (Profiler::isEnabled() ? 1 : 0);
+    std::cout<<"profile scope evaluated: "<<evaluated<<(compiled ? " ok" : " FAILED")<<std::endl;
+    profiler.clear();
+    profiler.record("test", "gemm", 0, 2, 10, 20);
+    profiler.record("test", "gemm", 2, 4, 10, 20);
+    Profiler::Summary summary = profiler.summary()["test/gemm"];
+    bool summed = summary.count == 2 && summary.time == 6 && summary.flops == 20 && summary.bytes == 40;
+    std::cout<<"profile summary"<<(summed ? " ok" : " FAILED")<<std::endl;
+    profiler.clear();
+    /* names go into a json string */
+    std::string escaped = Profiler::escape("a\"b\\c\n");
+    std::cout<<"trace escape: "<<escaped<<(escaped == "a\\\"b\\\\c\\u000a" ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_sampled_softmax()
+{
+    /* every class is a candidate and logQ is 0, so sampled softmax is the full softmax */
+    const int classNum = 5;
+    MLP<double, Sigmoid, SGD> sampled;
+    sampled.addLayer(INPUT, MSE, 6, 4, "input");
+    sampled.addLayer(OUTPUT, SAMPLED_SOFTMAX, classNum, "output");
+    sampled.connectLayer("input", "output");
+    sampled.generate();
+    sampled.sampler = CandidateSampler(classNum, false);
+    MLP<double, Sigmoid, SGD> full(sampled);
+    full.vertexs[full.outputIndex()].object.lossType = CROSS_ENTROPY;
+    for (int step = 0; step < 5; step++) {
+        MLP<double, Sigmoid, SGD>::Input x;
+        x["input"] = Mat<double>(4, 1, UNIFORM_RAND);
+        Mat<double> y(classNum, 1);
+        y[Random::uniform(classNum)][0] = 1;
+        sampled.training = true;
+        sampled.feedForward(x);
+        sampled.gradient(x, y);
+        sampled.optimize(0.1);
+        full.feedForward(x);
+        full.gradient(x, y);
+        full.optimize(0.1);
+    }
+    double error = 0;
+    for (std::size_t v = 0; v < full.vertexs.size(); v++) {
+        auto &layer = full.vertexs[v].object;
+        auto &sampledLayer = sampled.vertexs[v].object;
+        error = std::max(error, maxError(layer.W[0], sampledLayer.W[0]));
+        error = std::max(error, maxError(layer.B, sampledLayer.B));
+    }
+    std::cout<<"sampled softmax error: "<<error<<(error < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    /* inference runs the full softmax */
+    MLP<double, Sigmoid, SGD>::Input x;
+    x["input"] = Mat<double>(4, 1, UNIFORM_RAND);
+    sampled.training = false;
+    sampled.feedForward(x);
+    double total = sum(sampled.vertexs[sampled.outputIndex()].object.O);
+    std::cout<<"sampled softmax inference sum: "<<total<<(std::fabs(total - 1) < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_embedding()
+{
+    /* an embedding of ids is an input layer with W^T fed by the multi-hot vector of the ids */
+    const int vocabSize = 10;
+    MLP<double, Sigmoid, SGD> embedding;
+    embedding.addLayer(EMBEDDING, MSE, 6, vocabSize, "input");
+    embedding.addLayer(OUTPUT, MSE, 3, "output");
+    embedding.connectLayer("input", "output");
+    embedding.generate();
+    MLP<double, Sigmoid, SGD> dense;
+    dense.addLayer(INPUT, MSE, 6, vocabSize, "input");
+    dense.addLayer(OUTPUT, MSE, 3, "output");
+    dense.connectLayer("input", "output");
+    dense.generate();
+    dense.vertexs[0].object.W[0] = embedding.vertexs[0].object.W[0].Tr();
+    for (std::size_t v = 0; v < dense.vertexs.size(); v++) {
+        if (v > 0) {
+            dense.vertexs[v].object.W = embedding.vertexs[v].object.W;
+        }
+        dense.vertexs[v].object.B = embedding.vertexs[v].object.B;
+    }
+    MLP<double, Sigmoid, SGD>::Input ids;
+    MLP<double, Sigmoid, SGD>::Input multiHot;
+    for (int step = 0; step < 5; step++) {
+        /* two ids and a padding id per sample */
+        ids["input"] = Mat<double>(3, 1);
+        multiHot["input"] = Mat<double>(vocabSize, 1);
+        for (int i = 0; i < 2; i++) {
+            int id = Random::uniform(vocabSize);
+            ids["input"][i][0] = id;
+            multiHot["input"][id][0] += 1;
+        }
+        ids["input"][2][0] = -1;
+        Mat<double> y(3, 1, UNIFORM_RAND);
+        embedding.feedForward(ids);
+        embedding.gradient(ids, y);
+        embedding.optimize(0.1);
+        dense.feedForward(multiHot);
+        dense.gradient(multiHot, y);
+        dense.optimize(0.1);
+    }
+    double error = maxError(embedding.vertexs[0].object.W[0].Tr(), dense.vertexs[0].object.W[0]);
+    for (std::size_t v = 0; v < dense.vertexs.size(); v++) {
+        if (v > 0) {
+            error = std::max(error, maxError(embedding.vertexs[v].object.W[0], dense.vertexs[v].object.W[0]));
+        }
+        error = std::max(error, maxError(embedding.vertexs[v].object.B, dense.vertexs[v].object.B));
+    }
+    std::cout<<"embedding training error: "<<error<<(error < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    /* a sparse input holds the weights of the ids */
+    MLP<double, Sigmoid, SGD>::SparseInput sparseIds;
+    sparseIds["input"] = SparseMat<double>::fromDense(multiHot["input"]);
+    embedding.feedForward(ids);
+    Mat<double> o = embedding.vertexs[embedding.outputIndex()].object.O;
+    embedding.feedForward(sparseIds);
+    double sparseError = maxError(o, embedding.vertexs[embedding.outputIndex()].object.O);
+    std::cout<<"embedding sparse input error: "<<sparseError<<(sparseError < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_view()
+{
+    Mat<double> x(6, 5, UNIFORM_RAND);
+    Mat<double> origin(x);
+    /* writes through a block view land in x, the rest of x is untouched */
+    MatView<double> block = x.view(1, 2, 3, 2);
+    block *= 2;
+    Mat<double> delta(3, 2, UNIFORM_RAND);
+    block += delta.view();
+    bool written = true;
+    for (int i = 0; i < x.rows; i++) {
+        for (int j = 0; j < x.cols; j++) {
+            bool inside = i >= 1 && i < 4 && j >= 2 && j < 4;
+            double expect = inside ? 2 * origin[i][j] + delta[i - 1][j - 2] : origin[i][j];
+            written = written && x[i][j] == expect;
+        }
+    }
+    std::cout<<"view block write"<<(written ? " ok" : " FAILED")<<std::endl;
+    /* a row and a column of a block */
+    block.row(2).assign(7);
+    block.column(1).assign(Mat<double>(3, 1).view());
+    bool rowColumn = x[3][2] == 7 && x[1][3] == 0 && x[2][3] == 0 && x[3][3] == 0 && x[0][3] == origin[0][3];
+    std::cout<<"view row and column write"<<(rowColumn ? " ok" : " FAILED")<<std::endl;
+    /* Mat from a view copies like subset */
+    double copyError = maxError(Mat<double>(x.view(2, 1, 4, 3)), x.subset(2, 1, 4, 3));
+    std::cout<<"view copy error: "<<copyError<<(copyError == 0 ? " ok" : " FAILED")<<std::endl;
+    /* gemm on a slice of a batch in place */
+    Mat<double> A(4, 3, UNIFORM_RAND);
+    Mat<double> batch(3, 16, UNIFORM_RAND);
+    Mat<double> y(4, 16);
+    gemm(1.0, A.view(), NORMAL, batch.view(0, 5, 3, 4), NORMAL, 0.0, y.view(0, 5, 4, 4));
+    double gemmError = maxError(y.subset(0, 5, 4, 4), A * batch.subset(0, 5, 3, 4));
+    bool outside = sum(y.subset(0, 0, 4, 5)) == 0 && sum(y.subset(0, 9, 4, 7)) == 0;
+    std::cout<<"view gemm error: "<<gemmError<<(gemmError < 1e-12 && outside ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_philox()
+{
+    /* known answer of Philox4x32-10 from Random123, counter 0 and key 0 */
+    uint32_t r[4];
+    Philox()(0, r);
+    bool known = r[0] == 0x6627e8d5 && r[1] == 0xe169c58d && r[2] == 0xbc57ac4c && r[3] == 0x9b00dbd8;
+    std::cout<<"philox known answer"<<(known ? " ok" : " FAILED")<<std::endl;
+    /* element k does not depend on how a fill is split */
+    Philox engine(2024);
+    std::vector<double> whole(37);
+    std::vector<double> split(37);
+    engine.uniform(5, whole.data(), whole.size(), -1, 1);
+    engine.uniform(5, split.data(), 6, -1, 1);
+    engine.uniform(11, split.data() + 6, split.size() - 6, -1, 1);
+    std::vector<double> normal(37);
+    std::vector<double> splitNormal(37);
+    engine.normal(5, normal.data(), normal.size(), 0, 1);
+    engine.normal(5, splitNormal.data(), 3, 0, 1);
+    engine.normal(8, splitNormal.data() + 3, splitNormal.size() - 3, 0, 1);
+    bool splitable = whole == split && normal == splitNormal;
+    std::cout<<"philox split fill"<<(splitable ? " ok" : " FAILED")<<std::endl;
+    /* the same seed gives the same matrix, serial or on a pool */
+    ThreadPool pool(4);
+    Random::seed(42);
+    Mat<double> x(600, 500, UNIFORM_RAND);
+    Mat<double> y(600, 500);
+    y.normalRandom();
+    Random::seed(42);
+    Mat<double> px(600, 500);
+    px.uniformRandom(pool);
+    Mat<double> py(600, 500);
+    py.normalRandom(pool, 0, 1);
+    double error = std::max(maxError(x, px), maxError(y, py));
+    double mean = sum(x) / (600 * 500);
+    std::cout<<"philox parallel fill error: "<<error<<" mean: "<<mean
+             <<(error == 0 && std::fabs(mean) < 0.01 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_thread_pool()
+{
+    /* a throwing task must not return before the others are done with func */
+    ThreadPool pool(4);
+    for (int thrower : {0, 5}) {
+        std::atomic<int> finished(0);
+        bool caught = false;
+        try {
+            pool.parallelFor(64, [&](int i){
+                if (i == thrower) {
+                    throw std::runtime_error("task failed");
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                finished++;
+            });
+        } catch (const std::runtime_error &) {
+            caught = true;
+        }
+        std::cout<<"parallelFor throw from task "<<thrower<<" finished: "<<finished
+                 <<(caught && finished == 63 ? " ok" : " FAILED")<<std::endl;
+    }
+    std::atomic<int> count(0);
+    pool.parallelFor(16, [&](int){count++;});
+    std::cout<<"parallelFor after throw: "<<count<<(count == 16 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_softmax_cross_entropy()
+{
+    /* one-hot, soft and unnormalized labels, one sample per column */
+    Mat<double> x(5, 3, UNIFORM_RAND);
+    x *= 4;
+    Mat<double> label(5, 3);
+    label[2][0] = 1;
+    for (int i = 0; i < 5; i++) {
+        label[i][1] = 0.2;
+        label[i][2] = 0.5 * (i + 1) / 3;
+    }
+    Mat<double> prob;
+    Mat<double> dx;
+    double loss = softmaxCrossEntropy(x, label, prob, dx);
+    /* the mean over columns of -sum(label * log(softmax(x))) */
+    long double expect = 0;
+    for (int j = 0; j < x.cols; j++) {
+        long double z = 0;
+        for (int i = 0; i < x.rows; i++) {
+            z += std::exp((long double)x[i][j]);
+        }
+        for (int i = 0; i < x.rows; i++) {
+            expect -= label[i][j] * std::log(std::exp((long double)x[i][j]) / z);
+        }
+    }
+    expect /= x.cols;
+    double lossError = std::fabs(double(loss - expect));
+    std::cout<<"softmax cross entropy loss error: "<<lossError<<(lossError < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    /* dx is the gradient of the summed loss, by central differences */
+    const double h = 1e-5;
+    double gradientError = 0;
+    for (int i = 0; i < x.rows; i++) {
+        for (int j = 0; j < x.cols; j++) {
+            Mat<double> p;
+            Mat<double> d;
+            Mat<double> x1(x);
+            x1[i][j] += h;
+            double loss1 = softmaxCrossEntropy(x1, label, p, d) * x.cols;
+            Mat<double> x2(x);
+            x2[i][j] -= h;
+            double loss2 = softmaxCrossEntropy(x2, label, p, d) * x.cols;
+            gradientError = std::max(gradientError, std::fabs((loss1 - loss2) / (2 * h) - dx[i][j]));
+        }
+    }
+    std::cout<<"softmax cross entropy gradient error: "<<gradientError
+             <<(gradientError < 1e-8 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+/* distance in units in the last place, 0 for two nans or equal infinities */
+double ulpDistance(double x, double y)
+{
+    if (std::isnan(x) || std::isnan(y)) {
+        return std::isnan(x) && std::isnan(y) ? 0 : HUGE_VAL;
+    }
+    if (x == y) {
+        return 0;
+    }
+    if (std::isinf(x) || std::isinf(y)) {
+        return HUGE_VAL;
+    }
+    /* order the bit patterns so that adjacent doubles differ by 1 */
+    auto ordered = [](double v) {
+        int64_t i;
+        std::memcpy(&i, &v, sizeof(v));
+        return i < 0 ? INT64_MIN - i : i;
+    };
+    return std::fabs(double(ordered(x) - ordered(y)));
+}
+
+void test_vector_expr()
+{
+    /* a length that is not a multiple of the pack, so the scalar tail runs too */
+    const size_t N = 4099;
+    VectorExpr::Vector x(N);
+    for (size_t i = 0; i < N; i++) {
+        x.at(i) = -40 + 80.0 * i / N;
+    }
+    const double edges[] = {NAN, HUGE_VAL, -HUGE_VAL, 0.0, -0.0, 709.7, 710, 1000, -708, -740, -745.5,
+                            -1000, 1e-300, -1e-17, 0.6, -0.65, 19, -19, 25, -37};
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+        x.at(i) = edges[i];
+        x.at(N - 1 - i) = edges[i];
+    }
+    VectorExpr::Vector e = VectorExpr::EXP(x);
+    VectorExpr::Vector t = VectorExpr::TANH(x);
+    VectorExpr::Vector s = VectorExpr::SIGMOID(x);
+    double expUlp = 0;
+    double tanhUlp = 0;
+    double sigmoidUlp = 0;
+    for (size_t i = 0; i < N; i++) {
+        long double v = x[i];
+        expUlp = std::max(expUlp, ulpDistance(e[i], double(std::exp(v))));
+        tanhUlp = std::max(tanhUlp, ulpDistance(t[i], double(std::tanh(v))));
+        sigmoidUlp = std::max(sigmoidUlp, ulpDistance(s[i], double(1 / (1 + std::exp(-v)))));
+    }
+#ifdef __AVX2__
+    const char* path = "packed";
+#else
+    const char* path = "scalar";
+#endif
+    std::cout<<path<<" exp max ulp: "<<expUlp<<(expUlp <= 2 ? " ok" : " FAILED")<<std::endl;
+    std::cout<<path<<" tanh max ulp: "<<tanhUlp<<(tanhUlp <= 2 ? " ok" : " FAILED")<<std::endl;
+    std::cout<<path<<" sigmoid max ulp: "<<sigmoidUlp<<(sigmoidUlp <= 3 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_reduction()
+{
+    /* float, large terms of both signs that cancel plus small ones: sum(|x|) / |sum(x)| ~ 1e4 */
+    const int rows = 997;
+    const int cols = 1003;
+    Mat<float> x(rows, cols, UNIFORM_RAND);
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            x[i][j] = ((i + j) % 2 ? 1e4f : -1e4f) + x[i][j] + 1;
+        }
+    }
+    long double exact = 0;
+    long double absolute = 0;
+    long double squares = 0;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            exact += x[i][j];
+            absolute += std::fabs((long double)x[i][j]);
+            squares += (long double)x[i][j] * x[i][j];
+        }
+    }
+    const double eps = std::numeric_limits<float>::epsilon();
+    double pairwiseError = std::fabs(double(sum(x) - exact));
+    double kahanError = std::fabs(double(sum(x, KAHAN) - exact));
+    /* pairwise grows with log2(n), Kahan does not grow */
+    bool bounded = pairwiseError <= 32 * eps * absolute && kahanError <= 2 * eps * absolute + eps * std::fabs(exact);
+    std::cout<<"sum error pairwise: "<<pairwiseError<<" kahan: "<<kahanError
+             <<" of "<<double(exact)<<(bounded ? " ok" : " FAILED")<<std::endl;
+    double norm1Error = std::fabs(double(norm1(x) - absolute)) / absolute;
+    double norm2Error = std::fabs(double(norm2(x) - std::sqrt(squares))) / std::sqrt(squares);
+    double squaresError = std::fabs(double(sumSquares(x, KAHAN) - squares)) / squares;
+    std::cout<<"norm relative error 1: "<<norm1Error<<" 2: "<<norm2Error<<" squares: "<<squaresError
+             <<(norm1Error < 32 * eps && norm2Error < 32 * eps && squaresError < 4 * eps ? " ok" : " FAILED")<<std::endl;
+    /* the pool overloads combine the rows in the same order */
+    ThreadPool pool(4);
+    bool identical = sum(pool, x) == sum(x) && sum(pool, x, KAHAN) == sum(x, KAHAN) &&
+            norm1(pool, x) == norm1(x) && norm2(pool, x) == norm2(x);
+    std::cout<<"pool reduction"<<(identical ? " ok" : " FAILED")<<std::endl;
+    /* rows and columns */
+    Mat<float> r = rowSum(x, KAHAN);
+    Mat<float> c = columnSum(x);
+    Mat<float> rMax = rowMax(x);
+    Mat<float> rMin = rowMin(x);
+    Mat<float> cMax = columnMax(x);
+    Mat<float> cMin = columnMin(x);
+    bool rowsMatched = true;
+    for (int i = 0; i < rows; i++) {
+        long double s = 0;
+        long double a = 0;
+        for (int j = 0; j < cols; j++) {
+            s += x[i][j];
+            a += std::fabs((long double)x[i][j]);
+        }
+        rowsMatched = rowsMatched && std::fabs(double(r[i][0] - s)) <= 2 * eps * a + eps * std::fabs(s) &&
+                rMax[i][0] == *std::max_element(x[i].begin(), x[i].end()) &&
+                rMin[i][0] == *std::min_element(x[i].begin(), x[i].end());
+    }
+    bool columnsMatched = true;
+    for (int j = 0; j < cols; j++) {
+        long double s = 0;
+        long double a = 0;
+        float m = x[0][j];
+        float n = x[0][j];
+        for (int i = 0; i < rows; i++) {
+            s += x[i][j];
+            a += std::fabs((long double)x[i][j]);
+            m = std::max(m, x[i][j]);
+            n = std::min(n, x[i][j]);
+        }
+        columnsMatched = columnsMatched && std::fabs(double(c[0][j] - s)) <= rows * eps * a &&
+                cMax[0][j] == m && cMin[0][j] == n;
+    }
+    std::cout<<"row and column reductions"<<(rowsMatched && columnsMatched ? " ok" : " FAILED")<<std::endl;
+    /* extrema: the first position wins, in the tail of a row too */
+    x[5][1001] = 2e4f;
+    x[700][3] = 2e4f;
+    x[9][1002] = -2e4f;
+    x[400][7] = -2e4f;
+    Pos pMax = argmax(x);
+    Pos pMin = argmin(x);
+    bool extrema = max(x) == 2e4f && min(x) == -2e4f && pMax.i == 5 && pMax.j == 1001 && pMin.i == 9 && pMin.j == 1002;
+    std::cout<<"extrema"<<(extrema ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_sparse()
+{
+    /* prune 70% of a dense matrix, in both formats */
+    Mat<double> W(30, 40, UNIFORM_RAND);
+    Mat<double> dense(W);
+    SparseMat<double> csr = prune(W, 0.7);
+    SparseMat<double> csc = csr.convert(CSC);
+    /* only the smallest magnitudes are zeroed, the rest is unchanged */
+    int zeros = 0;
+    bool unchanged = true;
+    double kept = HUGE_VAL;
+    double dropped = 0;
+    for (int i = 0; i < W.rows; i++) {
+        for (int j = 0; j < W.cols; j++) {
+            if (W[i][j] == 0) {
+                zeros++;
+                dropped = std::max(dropped, std::fabs(dense[i][j]));
+            } else {
+                unchanged = unchanged && W[i][j] == dense[i][j];
+                kept = std::min(kept, std::fabs(W[i][j]));
+            }
+        }
+    }
+    bool pruned = zeros == int(0.7 * W.rows * W.cols) && csr.nnz() == W.rows * W.cols - zeros && dropped < kept && unchanged &&
+            maxError(csr.toDense(), W) == 0 && maxError(csc.toDense(), W) == 0 && maxError(csr.Tr().toDense(), W.Tr()) == 0;
+    std::cout<<"prune zeros: "<<zeros<<" nnz: "<<csr.nnz()<<(pruned ? " ok" : " FAILED")<<std::endl;
+    /* products of both formats against the dense product */
+    Mat<double> x(40, 7, UNIFORM_RAND);
+    Mat<double> xt(9, 30, UNIFORM_RAND);
+    /* a zero column of xt takes the skip in the CSR loop */
+    for (int i = 0; i < xt.rows; i++) {
+        xt[i][4] = 0;
+    }
+    double error = std::max(maxError(csr * x, W * x), maxError(csc * x, W * x));
+    error = std::max(error, std::max(maxError(xt * csr, xt * W), maxError(xt * csc, xt * W)));
+    Mat<double> dy(30, 7, UNIFORM_RAND);
+    Mat<double> dWSparse(30, 40);
+    Mat<double> dWDense(30, 40);
+    SparseMat<double> sx = SparseMat<double>::fromDense(x, CSC);
+    accumulateOuter(dWSparse, dy, sx);
+    gemm(1.0, dy, NORMAL, x, TRANSPOSE, 1.0, dWDense);
+    error = std::max(error, maxError(dWSparse, dWDense));
+    std::cout<<"sparse product error: "<<error<<(error < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    /* sparse input trains like the dense input */
+    MLP<double, Sigmoid, Adam> mlp;
+    mlp.addLayer(INPUT, MSE, 8, 40, "input");
+    mlp.addLayer(OUTPUT, MSE, 3, "output");
+    mlp.connectLayer("input", "output");
+    mlp.generate();
+    MLP<double, Sigmoid, Adam> sparseMlp(mlp);
+    double inputError = 0;
+    for (int step = 0; step < 5; step++) {
+        Mat<double> xi(40, 1, UNIFORM_RAND);
+        for (int i = 0; i < xi.rows; i += 3) {
+            xi[i][0] = 0;
+        }
+        MLP<double, Sigmoid, Adam>::Input in;
+        in["input"] = xi;
+        MLP<double, Sigmoid, Adam>::SparseInput sparseIn;
+        sparseIn["input"] = SparseMat<double>::fromDense(xi, step % 2 ? CSR : CSC);
+        Mat<double> y(3, 1, UNIFORM_RAND);
+        mlp.feedForward(in);
+        mlp.gradient(in, y);
+        mlp.optimize(0.01);
+        sparseMlp.feedForward(sparseIn);
+        sparseMlp.gradient(sparseIn, y);
+        sparseMlp.optimize(0.01);
+        inputError = std::max(inputError, maxError(mlp.vertexs[1].object.O, sparseMlp.vertexs[1].object.O));
+    }
+    inputError = std::max(inputError, maxError(mlp.vertexs[0].object.W[0], sparseMlp.vertexs[0].object.W[0]));
+    std::cout<<"sparse input error: "<<inputError<<(inputError < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    /* a pruned model runs the sparse kernels and keeps its pattern through training */
+    mlp.prune(0.5);
+    MLP<double, Sigmoid, Adam>::Input in;
+    in["input"] = Mat<double>(40, 1, UNIFORM_RAND);
+    mlp.feedForward(in);
+    Mat<double> o = mlp.vertexs[1].object.O;
+    Mat<double> expect = Sigmoid<double>::_(mlp.vertexs[1].object.W[0] *
+                                            Sigmoid<double>::_(mlp.vertexs[0].object.W[0] * in["input"] + mlp.vertexs[0].object.B) +
+                                            mlp.vertexs[1].object.B);
+    Mat<double> y(3, 1, UNIFORM_RAND);
+    mlp.gradient(in, y);
+    mlp.optimize(0.01);
+    int patternError = 0;
+    for (auto &v : mlp.vertexs) {
+        auto &layer = v.object;
+        patternError += maxError(layer.W[0], layer.SW[0].toDense()) != 0;
+        patternError += layer.SW[0].nnz() != int(layer.W[0].rows * layer.W[0].cols - int(0.5 * layer.W[0].rows * layer.W[0].cols));
+    }
+    double prunedError = maxError(o, expect);
+    std::cout<<"pruned forward error: "<<prunedError<<" pattern errors: "<<patternError
+             <<(prunedError < 1e-12 && patternError == 0 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+/* exact value of a finite half, independent of float16::toFloat */
+double halfValue(uint16_t h)
+{
+    int e = (h >> 10) & 0x1f;
+    int m = h & 0x3ff;
+    double x = e == 0 ? std::ldexp(double(m), -24) : std::ldexp(double(1024 + m), e - 25);
+    return h & 0x8000 ? -x : x;
+}
+float floatFromBits(uint32_t u)
+{
+    float x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+void test_half()
+{
+#ifdef __F16C__
+    std::cout<<"half conversion with f16c"<<std::endl;
+#else
+    std::cout<<"half conversion without f16c"<<std::endl;
+#endif
+    /*
+        every pair of neighbouring finite halves: the values convert exactly,
+        the midpoint goes to the even one and a float either side of it goes
+        to the nearer one. this covers subnormals and 65520 rounding to inf.
+    */
+    int f16Errors = 0;
+    for (uint32_t h = 0; h < 0x7c00; h++) {
+        float a = float(halfValue(uint16_t(h)));
+        float b = h + 1 == 0x7c00 ? 65536.0f : float(halfValue(uint16_t(h + 1)));
+        float mid = (a + b) / 2;
+        uint16_t even = uint16_t(h & 1 ? h + 1 : h);
+        f16Errors += float16::toFloat(uint16_t(h)) != a;
+        f16Errors += float16::toFloat(uint16_t(h | 0x8000)) != -a;
+        f16Errors += float16::fromFloat(a) != h;
+        f16Errors += float16::fromFloat(mid) != even;
+        f16Errors += float16::fromFloat(-mid) != (even | 0x8000);
+        f16Errors += float16::fromFloat(std::nextafter(mid, 0.0f)) != h;
+        f16Errors += float16::fromFloat(std::nextafter(mid, b + b)) != h + 1;
+    }
+    std::cout<<"float16 round to nearest even errors: "<<f16Errors<<(f16Errors == 0 ? " ok" : " FAILED")<<std::endl;
+    /* bfloat16 keeps the upper half of a float, the midpoint is the lower half 0x8000 */
+    int bf16Errors = 0;
+    for (uint32_t b = 0; b < 0x7f80; b++) {
+        uint32_t mid = (b << 16) | 0x8000;
+        uint16_t even = uint16_t(b & 1 ? b + 1 : b);
+        bf16Errors += bfloat16::fromFloat(bfloat16::toFloat(uint16_t(b))) != b;
+        bf16Errors += bfloat16::fromFloat(floatFromBits(mid)) != even;
+        bf16Errors += bfloat16::fromFloat(floatFromBits(mid | 0x80000000)) != (even | 0x8000);
+        bf16Errors += bfloat16::fromFloat(floatFromBits(mid - 1)) != b;
+        bf16Errors += bfloat16::fromFloat(floatFromBits(mid + 1)) != b + 1;
+    }
+    std::cout<<"bfloat16 round to nearest even errors: "<<bf16Errors<<(bf16Errors == 0 ? " ok" : " FAILED")<<std::endl;
+    /* overflow, inf and nan, including a nan whose payload is only in the low bits */
+    const float inf = std::numeric_limits<float>::infinity();
+    const float nan = floatFromBits(0x7f800001);
+    bool special = float16::fromFloat(65519.0f) == 0x7bff && float16::fromFloat(65520.0f) == 0x7c00 &&
+                   float16::fromFloat(std::numeric_limits<float>::max()) == 0x7c00 &&
+                   float16::fromFloat(inf) == 0x7c00 && float16::fromFloat(-inf) == 0xfc00 &&
+                   std::isinf(float16::toFloat(0x7c00)) && std::isnan(float16::toFloat(float16::fromFloat(nan))) &&
+                   std::isnan(float16::toFloat(float16::fromFloat(-nan))) &&
+                   float16::fromFloat(std::ldexp(1.0f, -26)) == 0 && float16::fromFloat(-std::ldexp(1.0f, -26)) == 0x8000 &&
+                   bfloat16::fromFloat(std::numeric_limits<float>::max()) == 0x7f80 &&
+                   bfloat16::fromFloat(inf) == 0x7f80 && bfloat16::fromFloat(-inf) == 0xff80 &&
+                   std::isnan(bfloat16::toFloat(bfloat16::fromFloat(nan))) &&
+                   std::isnan(bfloat16::toFloat(bfloat16::fromFloat(-nan)));
+    std::cout<<"half overflow, inf and nan"<<(special ? " ok" : " FAILED")<<std::endl;
+    /* bulk conversion agrees with the scalar one, 8 wide body and a tail */
+    std::vector<float> x(1003);
+    for (std::size_t i = 0; i < x.size(); i++) {
+        x[i] = float((Random::unit() * 2 - 1) * 70000 * std::pow(2.0, -int(i % 40)));
+    }
+    x[3] = inf;
+    x[10] = -inf;
+    x[17] = nan;
+    x[1001] = 65520.0f;
+    std::vector<float16> h(x.size());
+    std::vector<bfloat16> b(x.size());
+    convert(x.data(), h.data(), x.size());
+    convert(x.data(), b.data(), x.size());
+    std::vector<float> hx(x.size());
+    std::vector<float> bx(x.size());
+    convert(h.data(), hx.data(), h.size());
+    convert(b.data(), bx.data(), b.size());
+    int bulkErrors = 0;
+    for (std::size_t i = 0; i < x.size(); i++) {
+        bulkErrors += h[i].bits != float16::fromFloat(x[i]) || b[i].bits != bfloat16::fromFloat(x[i]);
+        float fh = float16::toFloat(h[i].bits);
+        float fb = bfloat16::toFloat(b[i].bits);
+        bulkErrors += !(hx[i] == fh || (std::isnan(hx[i]) && std::isnan(fh)));
+        bulkErrors += !(bx[i] == fb || (std::isnan(bx[i]) && std::isnan(fb)));
+    }
+    std::cout<<"half bulk conversion errors: "<<bulkErrors<<(bulkErrors == 0 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_loss_scaler()
+{
+    /* backoff halves the scale down to 1, growth doubles it after an interval of good steps up to 2^24 */
+    LossScaler scaler(1024, 3);
+    scaler.update(false);
+    scaler.update(false);
+    bool growth = scaler.scale == 1024;
+    scaler.update(false);
+    growth = growth && scaler.scale == 2048 && scaler.goodSteps == 0;
+    scaler.update(false);
+    scaler.update(false);
+    scaler.update(true);
+    bool backoff = scaler.scale == 1024 && scaler.goodSteps == 0;
+    scaler.update(false);
+    scaler.update(false);
+    backoff = backoff && scaler.scale == 1024;
+    for (int i = 0; i < 20; i++) {
+        scaler.update(true);
+    }
+    backoff = backoff && scaler.scale == 1;
+    scaler.scale = 8388608;
+    for (int i = 0; i < 9; i++) {
+        scaler.update(false);
+    }
+    growth = growth && scaler.scale == scaler.maxScale;
+    std::cout<<"loss scaler backoff"<<(backoff ? " ok" : " FAILED")
+             <<", growth"<<(growth ? " ok" : " FAILED")<<std::endl;
+    /* a power of two scale is undone exactly, so scaled training matches unscaled */
+    MLP<double, Sigmoid, Adam> mlp;
+    buildGraph(mlp);
+    MLP<double, Sigmoid, Adam> scaledMlp(mlp);
+    scaledMlp.scaler = LossScaler(65536, 2);
+    for (int step = 0; step < 4; step++) {
+        MLP<double, Sigmoid, Adam>::Input x = graphInput(1);
+        Mat<double> y(4, 1, UNIFORM_RAND);
+        mlp.feedForward(x);
+        mlp.gradient(x, y);
+        mlp.optimize(0.01);
+        scaledMlp.feedForward(x);
+        scaledMlp.gradient(x, y);
+        scaledMlp.optimize(0.01);
+    }
+    double error = 0;
+    for (std::size_t v = 0; v < mlp.vertexs.size(); v++) {
+        auto &layer = mlp.vertexs[v].object;
+        auto &scaledLayer = scaledMlp.vertexs[v].object;
+        for (std::size_t k = 0; k < layer.W.size(); k++) {
+            error = std::max(error, maxError(layer.W[k], scaledLayer.W[k]));
+        }
+        error = std::max(error, maxError(layer.B, scaledLayer.B));
+    }
+    bool grown = scaledMlp.scaler.scale == 262144;
+    std::cout<<"loss scaled training error: "<<error<<(error == 0 && grown ? " ok" : " FAILED")<<std::endl;
+    /* an overflowed gradient skips the step, clears the gradients and backs off */
+    MLP<double, Sigmoid, Adam>::Input x = graphInput(1);
+    Mat<double> y(4, 1, UNIFORM_RAND);
+    scaledMlp.feedForward(x);
+    scaledMlp.gradient(x, y);
+    auto &hidden = scaledMlp.vertexs[scaledMlp.vertexIndex["hidden3"]].object;
+    hidden.dW[0].data[0][0] = std::numeric_limits<double>::infinity();
+    std::vector<Mat<double> > W = hidden.W;
+    Mat<double> B = hidden.B;
+    scaledMlp.optimize(0.01);
+    bool skipped = maxError(W[0], hidden.W[0]) == 0 && maxError(B, hidden.B) == 0 &&
+                   isFinite(hidden.dW[0]) && sum(hidden.dW[0]) == 0 &&
+                   scaledMlp.scaler.scale == 131072 && scaledMlp.scaler.goodSteps == 0;
+    std::cout<<"loss scaled overflow"<<(skipped ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_adjacency()
+{
+    MLP<double, Sigmoid, Adam> mlp;
+    buildGraph(mlp);
+    /* nexts and previous are the adjacency lists, outSlot points back into inAdj */
+    bool valid = mlp.outAdj == mlp.nexts && mlp.inAdj == mlp.previous;
+    int edgeNum = 0;
+    for (std::size_t from = 0; from < mlp.vertexs.size(); from++) {
+        valid = valid && mlp.outSlot[from].size() == mlp.outAdj[from].size();
+        for (std::size_t k = 0; k < mlp.outAdj[from].size(); k++) {
+            const std::vector<int> &in = mlp.inAdj[mlp.outAdj[from][k]];
+            int slot = mlp.outSlot[from][k];
+            valid = valid && slot < int(in.size()) && in[slot] == int(from);
+            edgeNum++;
+        }
+        valid = valid && mlp.vertexs[from].indegree == int(mlp.inAdj[from].size());
+    }
+    valid = valid && edgeNum == int(mlp.edges.size());
+    /* input2 is the second input of hidden1 and the first of hidden3 */
+    int input2 = mlp.vertexIndex["input2"];
+    int hidden1 = mlp.vertexIndex["hidden1"];
+    int hidden3 = mlp.vertexIndex["hidden3"];
+    valid = valid && mlp.nexts[input2] == std::vector<int>({hidden1, hidden3}) &&
+            mlp.outSlot[input2] == std::vector<int>({1, 0}) &&
+            mlp.previous[hidden3] == std::vector<int>({input2, mlp.vertexIndex["input3"],
+                                                       hidden1, mlp.vertexIndex["hidden2"]});
+    std::cout<<"adjacency edges: "<<edgeNum<<(valid ? " ok" : " FAILED")<<std::endl;
+    /*
+        input2 and input3 reach hidden3 through two branches with equally
+        shaped weights, so the error is only right if backward takes the
+        weight of the slot the vertex has in each of its successors
+    */
+    MLP<double, Sigmoid, Adam>::Input x = graphInput(1);
+    Mat<double> y(4, 1, UNIFORM_RAND);
+    mlp.feedForward(x);
+    for (int i = mlp.topologySequence.size() - 1; i >= 0; i--) {
+        mlp.backwardVertex(mlp.topologySequence[i], y);
+    }
+    auto &h1 = mlp.vertexs[hidden1].object;
+    auto &h2 = mlp.vertexs[mlp.vertexIndex["hidden2"]].object;
+    auto &h3 = mlp.vertexs[hidden3].object;
+    Mat<double> e2(4, 1);
+    gemm(1.0, h1.W[1], TRANSPOSE, h1.E, NORMAL, 1.0, e2);
+    gemm(1.0, h3.W[0], TRANSPOSE, h3.E, NORMAL, 1.0, e2);
+    Mat<double> e3(4, 1);
+    gemm(1.0, h2.W[0], TRANSPOSE, h2.E, NORMAL, 1.0, e3);
+    gemm(1.0, h3.W[1], TRANSPOSE, h3.E, NORMAL, 1.0, e3);
+    Mat<double> e4(8, 1);
+    gemm(1.0, h3.W[3], TRANSPOSE, h3.E, NORMAL, 1.0, e4);
+    double error = std::max(maxError(e2, mlp.vertexs[input2].object.E),
+                            maxError(e3, mlp.vertexs[mlp.vertexIndex["input3"]].object.E));
+    error = std::max(error, maxError(e4, h2.E));
+    std::cout<<"multi branch error: "<<error<<(error < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_vertex_index()
+{
+    MLP<double, Sigmoid, Adam> mlp;
+    buildGraph(mlp);
+    /* every name maps to its vertex, in the copy and the clone too */
+    MLP<double, Sigmoid, Adam> copied(mlp);
+    MLP<double, Sigmoid, Adam>::Flat flat = mlp.clone();
+    bool found = mlp.vertexIndex.size() == mlp.vertexs.size();
+    for (std::size_t i = 0; i < mlp.vertexs.size(); i++) {
+        const std::string &name = mlp.vertexs[i].name;
+        found = found && mlp.findVertex(name) == int(i) &&
+                copied.findVertex(name) == int(i) && flat.findVertex(name) == int(i);
+    }
+    std::cout<<"vertex index lookup"<<(found ? " ok" : " FAILED")<<std::endl;
+    /* a missing name is -1, connects nothing and is skipped by index */
+    std::size_t edgeNum = mlp.edges.size();
+    mlp.connectLayer("input5", "hidden1");
+    mlp.connectLayer("hidden1", "hidden4");
+    mlp.insertEdge("input5", "hidden1");
+    MLP<double, Sigmoid, Adam>::Input x = graphInput(1);
+    x["input5"] = Mat<double>(4, 1, UNIFORM_RAND);
+    std::vector<Mat<double> > ix = mlp.index(x);
+    bool missing = mlp.findVertex("input5") == -1 && mlp.findVertex("") == -1 &&
+                   mlp.edges.size() == edgeNum && mlp.vertexs[mlp.findVertex("hidden1")].object.W.size() == 2 &&
+                   ix.size() == mlp.vertexs.size();
+    for (std::size_t i = 0; i < ix.size(); i++) {
+        const std::string &name = mlp.vertexs[i].name;
+        missing = missing && (x.count(name) ? maxError(ix[i], x[name]) == 0 : ix[i].isNull());
+    }
+    std::cout<<"vertex index missing name"<<(missing ? " ok" : " FAILED")<<std::endl;
+    /* the indexed input runs like the named one */
+    x.erase("input5");
+    mlp.feedForward(x);
+    Mat<double> o = mlp.vertexs[mlp.outputIndex()].object.O;
+    mlp.feedForward(mlp.index(x));
+    double error = maxError(o, mlp.vertexs[mlp.outputIndex()].object.O);
+    std::cout<<"vertex index input error: "<<error<<(error == 0 ? " ok" : " FAILED")<<std::endl;
+    /* a duplicate name is a new vertex, the name stays with the first one */
+    MLP<double, Sigmoid, Adam> duplicate;
+    duplicate.addLayer(INPUT, MSE, 4, 4, "input");
+    duplicate.addLayer(HIDDEN, MSE, 8, "hidden");
+    duplicate.addLayer(HIDDEN, MSE, 6, "hidden");
+    duplicate.addLayer(OUTPUT, MSE, 2, "output");
+    duplicate.connectLayer("input", "hidden");
+    duplicate.connectLayer("hidden", "output");
+    bool first = duplicate.vertexs.size() == 4 && duplicate.vertexIndex.size() == 3 &&
+                 duplicate.findVertex("hidden") == 1 && duplicate.vertexs[2].name == "hidden" &&
+                 duplicate.inAdj[1] == std::vector<int>({0}) && duplicate.inAdj[3] == std::vector<int>({1}) &&
+                 duplicate.inAdj[2].empty() && duplicate.vertexs[3].object.W[0].cols == 8;
+    std::cout<<"vertex index duplicate name"<<(first ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_pack_inputs()
+{
+    /* inputs of three different widths into one layer, a skip edge into the output */
+    MLP<double, Tanh, RMSProp> mlp;
+    mlp.addLayer(INPUT, MSE, 6, 3, "a");
+    mlp.addLayer(INPUT, MSE, 4, 5, "b");
+    mlp.addLayer(INPUT, MSE, 5, 7, "c");
+    mlp.addLayer(HIDDEN, MSE, 9, "mix");
+    mlp.addLayer(OUTPUT, MSE, 3, "output");
+    mlp.connectLayer("a", "mix");
+    mlp.connectLayer("b", "mix");
+    mlp.connectLayer("c", "mix");
+    mlp.connectLayer("mix", "output");
+    mlp.connectLayer("b", "output");
+    mlp.generate();
+    MLP<double, Tanh, RMSProp> packedMlp(mlp);
+    packedMlp.pack();
+    auto &mix = packedMlp.vertexs[packedMlp.findVertex("mix")].object;
+    auto &out = packedMlp.vertexs[packedMlp.outputIndex()].object;
+    bool packed = mix.isPacked() && out.isPacked() && mix.Wc.cols == 15 && out.Wc.cols == 13;
+    std::cout<<"packed inputs of different widths"<<(packed ? " ok" : " FAILED")<<std::endl;
+    /* the packed model trains on a pool like the unpacked one does serially */
+    ThreadPool pool(3);
+    double error = 0;
+    for (int step = 0; step < 6; step++) {
+        MLP<double, Tanh, RMSProp>::Input x;
+        x["a"] = Mat<double>(3, 1, UNIFORM_RAND);
+        x["b"] = Mat<double>(5, 1, UNIFORM_RAND);
+        x["c"] = Mat<double>(7, 1, UNIFORM_RAND);
+        Mat<double> y(3, 1, UNIFORM_RAND);
+        mlp.feedForward(x);
+        mlp.gradient(x, y);
+        mlp.optimize(0.01);
+        packedMlp.feedForward(x, pool);
+        packedMlp.gradient(x, y, pool);
+        packedMlp.optimize(0.01, pool);
+        error = std::max(error, maxError(mlp.vertexs[mlp.outputIndex()].object.O, out.O));
+    }
+    for (std::size_t v = 0; v < mlp.vertexs.size(); v++) {
+        auto &layer = mlp.vertexs[v].object;
+        auto &packedLayer = packedMlp.vertexs[v].object;
+        for (std::size_t k = 0; k < layer.W.size(); k++) {
+            error = std::max(error, maxError(layer.W[k], packedLayer.W[k]));
+        }
+        error = std::max(error, maxError(layer.B, packedLayer.B));
+    }
+    /* after the updates the concatenated weight still holds W[0], W[1], W[2] side by side */
+    int offset = 0;
+    for (auto &w : mix.W) {
+        error = std::max(error, maxError(w, mix.Wc.subset(0, offset, w.rows, w.cols)));
+        offset += w.cols;
+    }
+    std::cout<<"packed inputs training error: "<<error<<(error < 1e-12 ? " ok" : " FAILED")<<std::endl;
+    /* read-only forward of a batch, with and without a plan, then unpacked again */
+    MLP<double, Tanh, RMSProp>::Input x;
+    x["a"] = Mat<double>(3, 5, UNIFORM_RAND);
+    x["b"] = Mat<double>(5, 5, UNIFORM_RAND);
+    x["c"] = Mat<double>(7, 5, UNIFORM_RAND);
+    MemoryPlan plan = mlp.plan(5, false);
+    MLP<double, Tanh, RMSProp>::State O;
+    MLP<double, Tanh, RMSProp>::State packedO;
+    MLP<double, Tanh, RMSProp>::State plannedO;
+    int output = mlp.outputIndex();
+    mlp.feedForward(x, O);
+    packedMlp.feedForward(x, packedO);
+    packedMlp.feedForward(x, plannedO, plan);
+    double batchError = std::max(maxError(O[output], packedO[output]),
+                                 maxError(O[output], plannedO[plan.slotOf(output)]));
+    packedMlp.unpack();
+    MLP<double, Tanh, RMSProp>::State unpackedO;
+    packedMlp.feedForward(x, unpackedO);
+    batchError = std::max(batchError, maxError(O[output], unpackedO[output]));
+    bool unpacked = !mix.isPacked() && !out.isPacked();
+    std::cout<<"packed inputs batch error: "<<batchError<<(batchError < 1e-12 && unpacked ? " ok" : " FAILED")<<std::endl;
+    return;
+}
+void test_parallel_expand()
+{
+    /* 601 x 500 is above parallelThreshold and does not split evenly into the blocks */
+    ThreadPool pool(4);
+    Mat<double> x(601, 500, UNIFORM_RAND);
+    bool above = x.rows * x.cols >= Mat<double>::parallelThreshold;
+    Mat<double> y(x.rows, x.cols);
+    y.expand([&](int i, int j){y.data[i][j] = 2 * x.data[i][j] + i - j;});
+    Mat<double> py(x.rows, x.cols);
+    Mat<int> visits(x.rows, x.cols);
+    std::vector<std::thread::id> rowThread(x.rows);
+    py.parallel_expand(pool, [&](int i, int j){
+        py.data[i][j] = 2 * x.data[i][j] + i - j;
+        visits.data[i][j]++;
+        rowThread[i] = std::this_thread::get_id();
+    });
+    bool once = true;
+    for (int i = 0; i < visits.rows; i++) {
+        once = once && std::count(visits.data[i].begin(), visits.data[i].end(), 1) == visits.cols;
+    }
+    std::sort(rowThread.begin(), rowThread.end());
+    int threadNum = std::unique(rowThread.begin(), rowThread.end()) - rowThread.begin();
+    double error = maxError(y, py);
+    std::cout<<"parallel expand threads: "<<threadNum<<" error: "<<error
+             <<(above && once && threadNum > 1 && error == 0 ? " ok" : " FAILED")<<std::endl;
+    /* the element function gives the same bits serially and on the pool */
+    Mat<double> ex = for_each(x, [](double v){return std::exp(v) - v * v;});
+    Mat<double> pex = parallel_for_each(pool, x, [](double v){return std::exp(v) - v * v;});
+    Mat<float> fx = cast<float>(x);
+    Mat<float> tf = for_each(fx, [](float v){return std::tanh(v);});
+    Mat<float> ptf = parallel_for_each(pool, fx, [](float v){return std::tanh(v);});
+    bool same = maxError(ex, pex) == 0 && ptf.rows == tf.rows && ptf.cols == tf.cols;
+    for (int i = 0; i < tf.rows; i++) {
+        same = same && tf.data[i] == ptf.data[i];
+    }
+    std::cout<<"parallel for each"<<(same ? " ok" : " FAILED")<<std::endl;
+    /* below the threshold everything stays on the caller */
+    Mat<double> small(100, 100, UNIFORM_RAND);
+    Mat<double> ps = parallel_for_each(pool, small, [](double v){return v + 1;});
+    bool caller = true;
+    std::thread::id id = std::this_thread::get_id();
+    small.parallel_expand(pool, [&](int i, int j){
+        caller = caller && std::this_thread::get_id() == id;
+        small.data[i][j] += 1;
+    });
+    caller = caller && maxError(small, ps) == 0;
+    std::cout<<"parallel expand below threshold"<<(caller ? " ok" : " FAILED")<<std::endl;
+    return;
+}
 int main()
 {
-    srand((unsigned int)time(nullptr));
+    Random::seed(time(nullptr));
     test_lstm();
+    test_batch_predict();
+    test_quantize();
+    test_gemm();
+    test_staticmat();
+    test_levels();
+    test_pack();
+    test_plan();
+    test_profiler();
+    test_sampled_softmax();
+    test_embedding();
+    test_view();
+    test_philox();
+    test_thread_pool();
+    test_softmax_cross_entropy();
+    testVectorExpr();
+    test_vector_expr();
+    test_reduction();
+    test_sparse();
+    test_half();
+    test_loss_scaler();
+    test_adjacency();
+    test_vertex_index();
+    test_pack_inputs();
+    test_parallel_expand();
     return 0;
 }
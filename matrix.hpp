@@ -4,18 +4,41 @@
 #include <string>
 #include <fstream>
 #include <vector>
-#include <functional>
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
 #include <memory>
+#include <algorithm>
+#include <type_traits>
+#include "threadpool.hpp"
+#include "random.hpp"
+#ifdef USE_CBLAS
+#include <cblas.h>
+#endif
 namespace ML {
 
 
+/* type used to accumulate and evaluate functions of T */
+template<typename T>
+struct Accumulate
+{
+    using type = T;
+};
+
 enum MatType{
     ZERO = 0,
     IDENTITY,
-    UNIFORM_RAND
+    UNIFORM_RAND,
+    GAUSSIAN_RAND,
+    /* uniform in +-sqrt(6 / (rows + cols)), Glorot and Bengio 2010 */
+    XAVIER_RAND,
+    /* normal with stddev sqrt(2 / cols), He et al. 2015, for relu layers */
+    HE_RAND
+};
+/* operand form of gemm */
+enum Operation {
+    NORMAL = 0,
+    TRANSPOSE
 };
 class Pos
 {
@@ -27,6 +50,96 @@ public:
     Pos(int i_, int j_):i(i_), j(j_){}
 };
 
+/*
+    non-owning view of the block of a Mat with rows x cols elements at (row0, col0).
+    rows of a Mat are separate vectors, a view keeps them and a column offset:
+    operator[] gives a contiguous row, a column view steps over rows.
+    MatView<const T> is read only. views are O(1), the Mat must outlive them
+    and keep its shape.
+*/
+template<typename T>
+class MatView
+{
+public:
+    using Value = typename std::remove_const<T>::type;
+    using Rows = typename std::conditional<std::is_const<T>::value,
+                                           const std::vector<std::vector<Value> >,
+                                           std::vector<std::vector<Value> > >::type;
+public:
+    Rows *data;
+    int row0;
+    int col0;
+    int rows;
+    int cols;
+public:
+    MatView():data(nullptr), row0(0), col0(0), rows(0), cols(0){}
+    MatView(Rows &data_, int row0_, int col0_, int rows_, int cols_):
+        data(&data_), row0(row0_), col0(col0_), rows(rows_), cols(cols_){}
+    /* a writable view is also a read only one */
+    operator MatView<const Value>() const
+    {
+        return MatView<const Value>(*data, row0, col0, rows, cols);
+    }
+    inline bool isNull() const {return rows == 0 || cols == 0;}
+    template<typename U>
+    inline bool isShapeEqual(const MatView<U> &x) const {return rows == x.rows && cols == x.cols;}
+    inline T* operator[](int i) const {return (*data)[row0 + i].data() + col0;}
+    inline T& at(int i, int j) const {return (*data)[row0 + i][col0 + j];}
+    MatView view(int fromRow, int fromCol, int rows_, int cols_) const
+    {
+        return MatView(*data, row0 + fromRow, col0 + fromCol, rows_, cols_);
+    }
+    MatView row(int i) const {return view(i, 0, 1, cols);}
+    MatView column(int j) const {return view(0, j, rows, 1);}
+
+    void assign(Value x) const
+    {
+        for (int i = 0; i < rows; i++) {
+            T* y = (*this)[i];
+            for (int j = 0; j < cols; j++) {
+                y[j] = x;
+            }
+        }
+        return;
+    }
+    void assign(const MatView<const Value> &x) const
+    {
+        if (!isShapeEqual(x)) {
+            std::cout<<"view assign size is not matched"<<std::endl;
+            return;
+        }
+        for (int i = 0; i < rows; i++) {
+            std::copy(x[i], x[i] + cols, (*this)[i]);
+        }
+        return;
+    }
+    const MatView& operator += (const MatView<const Value> &x) const
+    {
+        if (!isShapeEqual(x)) {
+            std::cout<<"view += size is not matched"<<std::endl;
+            return *this;
+        }
+        for (int i = 0; i < rows; i++) {
+            T* y = (*this)[i];
+            const Value* xi = x[i];
+            for (int j = 0; j < cols; j++) {
+                y[j] += xi[j];
+            }
+        }
+        return *this;
+    }
+    const MatView& operator *= (Value x) const
+    {
+        for (int i = 0; i < rows; i++) {
+            T* y = (*this)[i];
+            for (int j = 0; j < cols; j++) {
+                y[j] *= x;
+            }
+        }
+        return *this;
+    }
+};
+
 template<typename T>
 class Mat
 {
@@ -34,6 +147,8 @@ public:
     int rows;
     int cols;
     std::vector<std::vector<T> > data;
+    /* elements below which parallel_expand stays on the caller */
+    static int parallelThreshold;
 public:
     Mat():rows(0), cols(0){}
     ~Mat(){}
@@ -41,7 +156,9 @@ public:
     inline bool isNull() const {return rows == 0 || cols == 0;}
     inline bool isSquare()const {return rows == cols;}
     inline T& at(int row, int col) {return data[row][col];}
+    inline const T& at(int row, int col) const {return data[row][col];}
     std::vector<T>& operator[](int i){return data[i];}
+    const std::vector<T>& operator[](int i) const {return data[i];}
     Mat& create(int rows, int cols)
     {
         this->rows = rows;
@@ -52,7 +169,9 @@ public:
         }
         return *this;
     }
-    void expand(std::function<void(int, int)> func)
+    /* func(i, j) for every element, the callable is inlined */
+    template<typename F>
+    void expand(F func)
     {
         for (int i = 0; i < rows; i++) {
             for (int j = 0; j < cols; j++) {
@@ -61,6 +180,40 @@ public:
         }
         return;
     }
+    /*
+        expand on row blocks of the pool, serial below parallelThreshold elements.
+        func must be safe to call concurrently on different rows,
+        and the caller must not be a task of the same pool
+    */
+    template<typename F>
+    void parallel_expand(ThreadPool &pool, F func)
+    {
+        parallel_rows(pool, [&](int i){
+            for (int j = 0; j < cols; j++) {
+                func(i, j);
+            }
+        });
+        return;
+    }
+    /* func(i) for every row, on row blocks of the pool as parallel_expand */
+    template<typename F>
+    void parallel_rows(ThreadPool &pool, F func) const
+    {
+        int blockNum = std::min(rows, pool.size() + 1);
+        if (rows * cols < parallelThreshold || blockNum < 2) {
+            for (int i = 0; i < rows; i++) {
+                func(i);
+            }
+            return;
+        }
+        pool.parallelFor(blockNum, [&](int k){
+            int end = rows * (k + 1) / blockNum;
+            for (int i = rows * k / blockNum; i < end; i++) {
+                func(i);
+            }
+        });
+        return;
+    }
     void assign(const Mat<T>& x)
     {
         for (int i = 0; i < rows; i++) {
@@ -71,7 +224,9 @@ public:
 
     void assign(T x)
     {
-        expand([this, x](int i, int j){data[i][j] = x;});
+        for (int i = 0; i < rows; i++) {
+            std::fill(data[i].begin(), data[i].end(), x);
+        }
         return;
     }
     void identity()
@@ -79,32 +234,88 @@ public:
         if (!isSquare()) {
             return;
         }
-        expand([this](int i, int j){data[i][j] = T(i == j);});
+        assign(0);
+        for (int i = 0; i < rows; i++) {
+            data[i][i] = 1;
+        }
         return;
     }
 
+    /*
+        random fills draw from the Random stream: element (i, j) is a function of
+        the seed and its index only, so the pool overloads give the same matrix
+    */
     void random(int minValue, int maxValue)
     {
-        expand([this, minValue, maxValue](int i, int j){
-            data[i][j] = T(minValue + rand() % (maxValue - minValue));
+        uint64_t offset = Random::reserve(uint64_t(rows) * cols);
+        Philox engine = Random::engine();
+        expand([&](int i, int j){
+            double u = Philox::toUnit(engine.at(offset + uint64_t(i) * cols + j));
+            data[i][j] = T(minValue + int(u * (maxValue - minValue)));
+        });
+        return;
+    }
+
+    void uniformRandom(double a = -1, double b = 1)
+    {
+        uint64_t offset = Random::reserve(uint64_t(rows) * cols);
+        Philox engine = Random::engine();
+        for (int i = 0; i < rows; i++) {
+            engine.uniform(offset + uint64_t(i) * cols, data[i].data(), cols, a, b);
+        }
+        return;
+    }
+
+    void uniformRandom(ThreadPool &pool, double a = -1, double b = 1)
+    {
+        uint64_t offset = Random::reserve(uint64_t(rows) * cols);
+        Philox engine = Random::engine();
+        parallel_rows(pool, [&](int i){
+            engine.uniform(offset + uint64_t(i) * cols, data[i].data(), cols, a, b);
         });
         return;
     }
 
-    void uniformRandom()
+    void normalRandom(double mean = 0, double stddev = 1)
+    {
+        uint64_t offset = Random::reserve(uint64_t(rows) * cols);
+        Philox engine = Random::engine();
+        for (int i = 0; i < rows; i++) {
+            engine.normal(offset + uint64_t(i) * cols, data[i].data(), cols, mean, stddev);
+        }
+        return;
+    }
+
+    void normalRandom(ThreadPool &pool, double mean = 0, double stddev = 1)
     {
-        expand([this](int i, int j){
-            data[i][j] = T(rand() % 10000 - rand() % 10000) / 10000;
+        uint64_t offset = Random::reserve(uint64_t(rows) * cols);
+        Philox engine = Random::engine();
+        parallel_rows(pool, [&](int i){
+            engine.normal(offset + uint64_t(i) * cols, data[i].data(), cols, mean, stddev);
         });
         return;
     }
 
+    /* weights are (fan out, fan in) */
+    void xavier()
+    {
+        double r = std::sqrt(6.0 / (rows + cols));
+        uniformRandom(-r, r);
+        return;
+    }
+
+    void he()
+    {
+        normalRandom(0, std::sqrt(2.0 / cols));
+        return;
+    }
+
     Mat(int rows, int cols, MatType type = ZERO)
     {
         create(rows, cols);
         switch (type) {
         case ZERO:
-            assign(0);
+            /* create zeroes already */
             break;
         case IDENTITY:
             identity();
@@ -112,6 +323,15 @@ public:
         case UNIFORM_RAND:
             uniformRandom();
             break;
+        case GAUSSIAN_RAND:
+            normalRandom();
+            break;
+        case XAVIER_RAND:
+            xavier();
+            break;
+        case HE_RAND:
+            he();
+            break;
         default:
             break;
         }
@@ -145,25 +365,43 @@ public:
 
     void zero(){ assign(0);}
 
-    std::vector<T> column(int col)
+    /* copy of a view */
+    template<typename U>
+    Mat(const MatView<U> &x)
     {
-        std::vector<T> columnT;
-        expand([this, &columnT, col](int i, int j){
-            if (j == col) {
-                columnT.push_back(data[i][j]);
-            }
-        });
-        return columnT;
+        create(x.rows, x.cols);
+        for (int i = 0; i < rows; i++) {
+            std::copy(x[i], x[i] + cols, data[i].begin());
+        }
+    }
+
+    /* O(1) views, see MatView */
+    MatView<T> view() {return MatView<T>(data, 0, 0, rows, cols);}
+    MatView<const T> view() const {return MatView<const T>(data, 0, 0, rows, cols);}
+    MatView<T> view(int fromRow, int fromCol, int rowOffset, int colOffset)
+    {
+        return MatView<T>(data, fromRow, fromCol, rowOffset, colOffset);
+    }
+    MatView<const T> view(int fromRow, int fromCol, int rowOffset, int colOffset) const
+    {
+        return MatView<const T>(data, fromRow, fromCol, rowOffset, colOffset);
     }
+    MatView<T> row(int i) {return view(i, 0, 1, cols);}
+    MatView<const T> row(int i) const {return view(i, 0, 1, cols);}
+    MatView<T> column(int j) {return view(0, j, rows, 1);}
+    MatView<const T> column(int j) const {return view(0, j, rows, 1);}
 
-    std::vector<T> toVector()
+    std::vector<T> toVector() const
     {
         std::vector<T> x;
-        expand([this, &x](int i, int j){x.push_back(data[i][j]);});
+        x.reserve(rows * cols);
+        for (int i = 0; i < rows; i++) {
+            x.insert(x.end(), data[i].begin(), data[i].end());
+        }
         return x;
     }
 
-    void show()
+    void show() const
     {
         for (int i = 0; i < rows; i++) {
             for (int j = 0; j < cols; j++) {
@@ -174,7 +412,7 @@ public:
         return;
     }
 
-    Mat operator + (const Mat& x)
+    Mat operator + (const Mat& x) const
     {
         if (!isShapeEqual(x)) {
             std::cout<<"+ size is not matched"<<std::endl;
@@ -189,7 +427,7 @@ public:
         return y;
     }
 
-    Mat operator - (const Mat& x)
+    Mat operator - (const Mat& x) const
     {
         if (!isShapeEqual(x)) {
             std::cout<<"- size is not matched"<<std::endl;
@@ -206,28 +444,19 @@ public:
         return y;
     }
 
-    Mat operator * (const Mat& x)
+    Mat operator * (const Mat& x) const
     {
         if (cols != x.rows) {
             std::cout<<"* size is not matched"<<std::endl;
             return *this;
         }
         /* (m, p) x (p, n) = (m, n) */
-        int m = rows;
-        int p = cols;
-        int n = x.cols;
-        Mat y(m, n);
-        for (int i = 0; i < m; i++) {
-            for (int j = 0; j < n; j++) {
-                for (int k = 0; k < p; k++) {
-                    y.data[i][j] += data[i][k] * x.data[k][j];
-                }
-            }
-        }
+        Mat y(rows, x.cols);
+        gemm(T(1), *this, NORMAL, x, NORMAL, T(0), y);
         return y;
     }
 
-    Mat operator / (const Mat& x)
+    Mat operator / (const Mat& x) const
     {
         if (!isShapeEqual(x)) {
             std::cout<<"/ size is not matched"<<std::endl;
@@ -242,7 +471,7 @@ public:
         return y;
     }
 
-    Mat operator % (const Mat& x)
+    Mat operator % (const Mat& x) const
     {
         if (!isShapeEqual(x)) {
             std::cout<<"% size is not matched"<<std::endl;
@@ -313,7 +542,7 @@ public:
         return *this;
     }
 
-    Mat operator + (T x)
+    Mat operator + (T x) const
     {
         Mat y(rows, cols);
         for (int i = 0; i < rows; i++) {
@@ -324,7 +553,7 @@ public:
         return y;
     }
 
-    Mat operator - (T x)
+    Mat operator - (T x) const
     {
         Mat y(rows, cols);
         for (int i = 0; i < rows; i++) {
@@ -335,7 +564,7 @@ public:
         return y;
     }
 
-    Mat operator * (T x)
+    Mat operator * (T x) const
     {
         Mat y(rows, cols);
         for (int i = 0; i < rows; i++) {
@@ -346,7 +575,7 @@ public:
         return y;
     }
 
-    Mat operator / (T x)
+    Mat operator / (T x) const
     {
         Mat y(rows, cols);
         for (int i = 0; i < rows; i++) {
@@ -400,38 +629,59 @@ public:
     Mat Tr() const
     {
         Mat y(cols,rows);
-        for (int i = 0; i < rows; i++) {
-            for (int j = 0; j < cols; j++) {
-                y.data[j][i] = data[i][j];
+        transposeTo(y, 0, rows, 0, cols);
+        return y;
+    }
+
+    /* cache oblivious: halve the longer side until the block is small */
+    void transposeTo(Mat &y, int r0, int r1, int c0, int c1) const
+    {
+        if ((r1 - r0) * (c1 - c0) <= 256) {
+            for (int i = r0; i < r1; i++) {
+                for (int j = c0; j < c1; j++) {
+                    y.data[j][i] = data[i][j];
+                }
             }
+            return;
         }
-        return y;
+        if (r1 - r0 >= c1 - c0) {
+            int r = (r0 + r1) / 2;
+            transposeTo(y, r0, r, c0, c1);
+            transposeTo(y, r, r1, c0, c1);
+        } else {
+            int c = (c0 + c1) / 2;
+            transposeTo(y, r0, r1, c0, c);
+            transposeTo(y, r0, r1, c, c1);
+        }
+        return;
     }
 
-    Mat subset(int fromRow, int fromCol, int rowOffset, int colOffset)
+    /* copy of a block, the part outside of this matrix is zero. view() does not copy */
+    Mat subset(int fromRow, int fromCol, int rowOffset, int colOffset) const
     {
-        Mat y(rowOffset, colOffset);
         int r = (fromRow + rowOffset > rows)?rows:(fromRow + rowOffset);
         int c = (fromCol + colOffset > cols)?cols:(fromCol + colOffset);
-        for (int i = fromRow; i < r; i++) {
-            for (int j = fromCol; j < c; j++) {
-                y.data[i - fromRow][j - fromCol] = data[i][j];
-            }
+        if (r - fromRow == rowOffset && c - fromCol == colOffset) {
+            return Mat(view(fromRow, fromCol, rowOffset, colOffset));
         }
+        Mat y(rowOffset, colOffset);
+        y.view(0, 0, r - fromRow, c - fromCol).assign(view(fromRow, fromCol, r - fromRow, c - fromCol));
         return y;
     }
 
-    void set(int fromRow, int fromCol, const Mat &x)
+    /* write x at (fromRow, fromCol), the part outside of this matrix is dropped */
+    template<typename U>
+    void set(int fromRow, int fromCol, const MatView<U> &x)
     {
         int r = (fromRow + x.rows > rows)?rows:(fromRow + x.rows);
         int c = (fromCol + x.cols > cols)?cols:(fromCol + x.cols);
-        for (int i = fromRow; i < r; i++) {
-            for (int j = fromCol; j < c; j++) {
-                data[i][j] = x.data[i - fromRow][j - fromCol];
-            }
-        }
+        view(fromRow, fromCol, r - fromRow, c - fromCol).assign(x.view(0, 0, r - fromRow, c - fromCol));
         return;
     }
+    void set(int fromRow, int fromCol, const Mat &x)
+    {
+        return set(fromRow, fromCol, x.view());
+    }
     void save(const std::string& fileName)
     {
         std::ofstream file;
@@ -458,39 +708,228 @@ public:
     }
 };
 template<typename T>
-Mat<T> for_each(const Mat<T>& x, std::function<double(double)> func)
+int Mat<T>::parallelThreshold = 1 << 18;
+
+template<typename T, typename F>
+Mat<T> for_each(const Mat<T>& x, F func)
 {
+    using A = typename Accumulate<T>::type;
     Mat<T> y(x.rows, x.cols);
     for (int i = 0; i < x.rows; i++) {
+        const T* xi = x.data[i].data();
+        T* yi = y.data[i].data();
         for (int j = 0; j < x.cols; j++) {
-            y.data[i][j] = func(x.data[i][j]);
+            yi[j] = T(func(A(xi[j])));
         }
     }
     return y;
 }
 
+/* for_each on row blocks of the pool, see Mat::parallel_expand */
+template<typename T, typename F>
+Mat<T> parallel_for_each(ThreadPool &pool, const Mat<T>& x, F func)
+{
+    using A = typename Accumulate<T>::type;
+    Mat<T> y(x.rows, x.cols);
+    y.parallel_expand(pool, [&](int i, int j){
+        y.data[i][j] = T(func(A(x.data[i][j])));
+    });
+    return y;
+}
+
 template<typename T>
-T sum(const Mat<T>& x)
+bool isFinite(const Mat<T>& x)
 {
-    T s = 0;
     for (int i = 0; i < x.rows; i++) {
         for (int j = 0; j < x.cols; j++) {
-            s += x.data[i][j];
+            if (!std::isfinite(double(x.data[i][j]))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* element type conversion, specialized for low precision types */
+template<typename Ty, typename Tx>
+void convert(const Tx *x, Ty *y, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        y[i] = Ty(x[i]);
+    }
+    return;
+}
+
+template<typename Ty, typename Tx>
+Mat<Ty> cast(const Mat<Tx>& x)
+{
+    Mat<Ty> y(x.rows, x.cols);
+    for (int i = 0; i < x.rows; i++) {
+        convert(x.data[i].data(), y.data[i].data(), x.cols);
+    }
+    return y;
+}
+
+/*
+    reductions. a row is reduced through its pointer with 8 independent partial sums,
+    which the compiler keeps in vector registers, and longer runs are split in halves,
+    so the rounding error grows with log(n) rather than n. row results are combined
+    the same way, in row order, so the pool overloads return the same value as the
+    serial ones for any thread count. KAHAN compensates every addition instead.
+*/
+enum Summation {
+    PAIRWISE = 0,
+    KAHAN
+};
+
+/* sum of f(x[i]) for i in [0, n) */
+template<typename A, typename T, typename F>
+A pairwiseSum(const T *x, int n, F f)
+{
+    if (n > 256) {
+        int half = (n / 2) & ~7;
+        return pairwiseSum<A>(x, half, f) + pairwiseSum<A>(x + half, n - half, f);
+    }
+    A s[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int l = 0; l < 8; l++) {
+            s[l] += A(f(x[i + l]));
         }
     }
+    for (; i < n; i++) {
+        s[i & 7] += A(f(x[i]));
+    }
+    return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+}
+
+template<typename A, typename T, typename F>
+A kahanSum(const T *x, int n, F f)
+{
+    A s = 0;
+    A c = 0;
+    for (int i = 0; i < n; i++) {
+        A y = A(f(x[i])) - c;
+        A t = s + y;
+        c = (t - s) - y;
+        s = t;
+    }
     return s;
 }
 
+template<typename A, typename T, typename F>
+inline A sumOf(const T *x, int n, F f, Summation method)
+{
+    return method == KAHAN ? kahanSum<A>(x, n, f) : pairwiseSum<A>(x, n, f);
+}
+
+template<typename T, typename F>
+typename Accumulate<T>::type reduceSum(const Mat<T> &x, F f, Summation method)
+{
+    using A = typename Accumulate<T>::type;
+    std::vector<A> partial(x.rows);
+    for (int i = 0; i < x.rows; i++) {
+        partial[i] = sumOf<A>(x.data[i].data(), x.cols, f, method);
+    }
+    return sumOf<A>(partial.data(), x.rows, [](A v){return v;}, method);
+}
+
+template<typename T, typename F>
+typename Accumulate<T>::type reduceSum(ThreadPool &pool, const Mat<T> &x, F f, Summation method)
+{
+    using A = typename Accumulate<T>::type;
+    std::vector<A> partial(x.rows);
+    x.parallel_rows(pool, [&](int i){
+        partial[i] = sumOf<A>(x.data[i].data(), x.cols, f, method);
+    });
+    return sumOf<A>(partial.data(), x.rows, [](A v){return v;}, method);
+}
+
+template<typename T>
+T sum(const Mat<T>& x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    return T(reduceSum(x, [](A v){return v;}, method));
+}
+
+template<typename T>
+T sum(ThreadPool &pool, const Mat<T>& x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    return T(reduceSum(pool, x, [](A v){return v;}, method));
+}
+
+/* sum of |x| */
+template<typename T>
+T norm1(const Mat<T>& x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    return T(reduceSum(x, [](A v){return v < 0 ? -v : v;}, method));
+}
+
+template<typename T>
+T norm1(ThreadPool &pool, const Mat<T>& x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    return T(reduceSum(pool, x, [](A v){return v < 0 ? -v : v;}, method));
+}
+
+/* sum of x^2, adds up to the norm of several matrices, see LSTM::clip */
+template<typename T>
+T sumSquares(const Mat<T>& x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    return T(reduceSum(x, [](A v){return v * v;}, method));
+}
+
+template<typename T>
+T sumSquares(ThreadPool &pool, const Mat<T>& x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    return T(reduceSum(pool, x, [](A v){return v * v;}, method));
+}
+
+/* euclidean norm of the elements, the Frobenius norm of a matrix */
+template<typename T>
+T norm2(const Mat<T>& x, Summation method = PAIRWISE)
+{
+    return T(std::sqrt(typename Accumulate<T>::type(sumSquares(x, method))));
+}
+
+template<typename T>
+T norm2(ThreadPool &pool, const Mat<T>& x, Summation method = PAIRWISE)
+{
+    return T(std::sqrt(typename Accumulate<T>::type(sumSquares(pool, x, method))));
+}
+
+/* the element e of x[0, n) with better(e, other) for no other element, 8 lanes as pairwiseSum */
+template<typename T, typename F>
+T extremum(const T *x, int n, F better)
+{
+    T m[8];
+    std::fill(m, m + 8, x[0]);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int l = 0; l < 8; l++) {
+            m[l] = better(x[i + l], m[l]) ? x[i + l] : m[l];
+        }
+    }
+    for (; i < n; i++) {
+        m[0] = better(x[i], m[0]) ? x[i] : m[0];
+    }
+    for (int l = 1; l < 8; l++) {
+        m[0] = better(m[l], m[0]) ? m[l] : m[0];
+    }
+    return m[0];
+}
+
 template<typename T>
 T max(const Mat<T>& x)
 {
     T maxT = x.data[0][0];
     for (int i = 0; i < x.rows; i++) {
-        for (int j = 0; j < x.cols; j++) {
-            if (maxT < x.data[i][j]) {
-                maxT = x.data[i][j];
-            }
-        }
+        T m = extremum(x.data[i].data(), x.cols, [](T a, T b){return a > b;});
+        maxT = m > maxT ? m : maxT;
     }
     return maxT;
 }
@@ -500,45 +939,118 @@ T min(const Mat<T>& x)
 {
     T minT = x.data[0][0];
     for (int i = 0; i < x.rows; i++) {
-        for (int j = 0; j < x.cols; j++) {
-            if (minT > x.data[i][j]) {
-                minT = x.data[i][j];
-            }
-        }
+        T m = extremum(x.data[i].data(), x.cols, [](T a, T b){return a < b;});
+        minT = m < minT ? m : minT;
     }
     return minT;
 }
 
+/* first position of the best element: the row by its extremum, then the column in that row */
+template<typename T, typename F>
+Pos argExtremum(const Mat<T>& x, F better)
+{
+    int row = 0;
+    T best = x.data[0][0];
+    for (int i = 0; i < x.rows; i++) {
+        T m = extremum(x.data[i].data(), x.cols, better);
+        if (better(m, best)) {
+            best = m;
+            row = i;
+        }
+    }
+    int col = std::find(x.data[row].begin(), x.data[row].end(), best) - x.data[row].begin();
+    return Pos(row, col);
+}
+
 template<typename T>
 Pos argmax(const Mat<T>& x)
 {
-    Pos pos;
-    T maxT = x.data[0][0];
+    return argExtremum(x, [](T a, T b){return a > b;});
+}
+
+template<typename T>
+Pos argmin(const Mat<T>& x)
+{
+    return argExtremum(x, [](T a, T b){return a < b;});
+}
+
+/* reductions of every row, (rows, 1) */
+template<typename T>
+Mat<T> rowSum(const Mat<T>& x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    Mat<T> y(x.rows, 1);
+    for (int i = 0; i < x.rows; i++) {
+        y.data[i][0] = T(sumOf<A>(x.data[i].data(), x.cols, [](A v){return v;}, method));
+    }
+    return y;
+}
+
+template<typename T>
+Mat<T> rowMax(const Mat<T>& x)
+{
+    Mat<T> y(x.rows, 1);
+    for (int i = 0; i < x.rows; i++) {
+        y.data[i][0] = *std::max_element(x.data[i].begin(), x.data[i].end());
+    }
+    return y;
+}
+
+template<typename T>
+Mat<T> rowMin(const Mat<T>& x)
+{
+    Mat<T> y(x.rows, 1);
+    for (int i = 0; i < x.rows; i++) {
+        y.data[i][0] = *std::min_element(x.data[i].begin(), x.data[i].end());
+    }
+    return y;
+}
+
+/* reductions of every column (one sample per column), (1, cols). rows are walked in order */
+template<typename T>
+Mat<T> columnSum(const Mat<T>& x)
+{
+    using A = typename Accumulate<T>::type;
+    std::vector<A> s(x.cols, 0);
     for (int i = 0; i < x.rows; i++) {
+        const T* xi = x.data[i].data();
         for (int j = 0; j < x.cols; j++) {
-            if (maxT < x.data[i][j]) {
-                maxT = x.data[i][j];
-                pos = Pos(i, j);
-            }
+            s[j] += A(xi[j]);
         }
     }
-    return pos;
+    Mat<T> y(1, x.cols);
+    std::copy(s.begin(), s.end(), y.data[0].begin());
+    return y;
 }
 
 template<typename T>
-Pos argmin(Mat<T>& x)
+Mat<T> columnMax(const Mat<T>& x)
 {
-    Pos pos;
-    T minT = x.data[0][0];
-    for (int i = 0; i < x.rows; i++) {
+    Mat<T> y(1, x.cols);
+    y.data[0] = x.data[0];
+    T* y0 = y.data[0].data();
+    for (int i = 1; i < x.rows; i++) {
+        const T* xi = x.data[i].data();
         for (int j = 0; j < x.cols; j++) {
-            if (minT > x.data[i][j]) {
-                minT = x.data[i][j];
-                pos = Pos(i, j);
-            }
+            y0[j] = y0[j] < xi[j] ? xi[j] : y0[j];
+        }
+    }
+    return y;
+}
+
+template<typename T>
+Mat<T> columnMin(const Mat<T>& x)
+{
+    Mat<T> y(1, x.cols);
+    y.data[0] = x.data[0];
+    T* y0 = y.data[0].data();
+    for (int i = 1; i < x.rows; i++) {
+        const T* xi = x.data[i].data();
+        for (int j = 0; j < x.cols; j++) {
+            y0[j] = y0[j] > xi[j] ? xi[j] : y0[j];
         }
     }
-    return pos;
+    return y;
 }
 
 template <typename T>
@@ -558,52 +1070,371 @@ Mat<T> Kronecker(const Mat<T> &x1, const Mat<T> &x2)
     }
     return y;
 }
-inline double sigmoid(double x){return exp(x) / (exp(x) + 1);}
-inline double relu(double x){return x > 0 ? x : 0;}
-inline double linear(double x){return x;}
-inline double dsigmoid(double y){return y * (1 - y);}
-inline double drelu(double y){return y > 0 ? 1 : 0;}
-inline double dtanh(double y){return 1 - y * y;}
-inline double dlinear(double){return 1;}
+/* in-tree gemm kernel, shapes are checked by gemm */
+template <typename T>
+void gemmKernel(T alpha, const MatView<const T> &A, Operation opA,
+                const MatView<const T> &B, Operation opB, T beta, const MatView<T> &C)
+{
+    using Acc = typename Accumulate<T>::type;
+    int m = C.rows;
+    int n = C.cols;
+    int p = opA == NORMAL ? A.cols : A.rows;
+    std::vector<Acc> s(n);
+    for (int i = 0; i < m; i++) {
+        if (opB == NORMAL && n == 1) {
+            /* matrix vector: a dot product with the column of B */
+            Acc d = 0;
+            if (opA == NORMAL) {
+                const T* a = A[i];
+                for (int k = 0; k < p; k++) {
+                    d += a[k] * Acc(B[k][0]);
+                }
+            } else {
+                for (int k = 0; k < p; k++) {
+                    d += Acc(A[k][i]) * Acc(B[k][0]);
+                }
+            }
+            s[0] = d;
+        } else if (opB == NORMAL) {
+            /* row i of C accumulates rows of B */
+            std::fill(s.begin(), s.end(), Acc(0));
+            for (int k = 0; k < p; k++) {
+                Acc a = opA == NORMAL ? A[i][k] : A[k][i];
+                const T* b = B[k];
+                for (int j = 0; j < n; j++) {
+                    s[j] += a * Acc(b[j]);
+                }
+            }
+        } else {
+            /* C[i][j] is a dot product with row j of B */
+            for (int j = 0; j < n; j++) {
+                const T* b = B[j];
+                Acc d = 0;
+                if (opA == NORMAL) {
+                    const T* a = A[i];
+                    for (int k = 0; k < p; k++) {
+                        d += a[k] * b[k];
+                    }
+                } else {
+                    for (int k = 0; k < p; k++) {
+                        d += A[k][i] * b[k];
+                    }
+                }
+                s[j] = d;
+            }
+        }
+        T* c = C[i];
+        if (beta == T(0)) {
+            for (int j = 0; j < n; j++) {
+                c[j] = Acc(alpha) * s[j];
+            }
+        } else {
+            for (int j = 0; j < n; j++) {
+                c[j] = Acc(alpha) * s[j] + Acc(beta) * Acc(c[j]);
+            }
+        }
+    }
+    return;
+}
+
+#ifdef USE_CBLAS
+/*
+    system cblas (OpenBLAS, BLIS, ...) for float and double, other types use gemmKernel.
+    Mat rows are separate vectors, so the operands are packed into contiguous
+    row major buffers. Products smaller than threshold multiply-adds stay in tree
+    because packing would cost more than it saves.
+*/
+template<typename T>
+struct CBlas
+{
+    static int threshold;
+    static bool gemm(T, const MatView<const T> &, Operation, const MatView<const T> &, Operation, T, const MatView<T> &)
+    {
+        return false;
+    }
+};
+template<typename T>
+int CBlas<T>::threshold = 32768;
+
+template<typename T>
+void packRows(const MatView<const T> &x, std::vector<T> &buffer)
+{
+    buffer.resize(x.rows * x.cols);
+    for (int i = 0; i < x.rows; i++) {
+        std::copy(x[i], x[i] + x.cols, buffer.begin() + i * x.cols);
+    }
+    return;
+}
+
+template<typename T, typename F>
+bool cblasGemm(F f, T alpha, const MatView<const T> &A, Operation opA,
+               const MatView<const T> &B, Operation opB, T beta, const MatView<T> &C)
+{
+    int p = opA == NORMAL ? A.cols : A.rows;
+    if (C.rows * C.cols * p < CBlas<T>::threshold) {
+        return false;
+    }
+    std::vector<T> a;
+    std::vector<T> b;
+    std::vector<T> c;
+    packRows(A, a);
+    packRows(B, b);
+    if (beta == T(0)) {
+        c.resize(C.rows * C.cols);
+    } else {
+        packRows<T>(C, c);
+    }
+    f(CblasRowMajor, opA == NORMAL ? CblasNoTrans : CblasTrans, opB == NORMAL ? CblasNoTrans : CblasTrans,
+      C.rows, C.cols, p, alpha, a.data(), A.cols, b.data(), B.cols, beta, c.data(), C.cols);
+    for (int i = 0; i < C.rows; i++) {
+        std::copy(c.begin() + i * C.cols, c.begin() + (i + 1) * C.cols, C[i]);
+    }
+    return true;
+}
+
+template<>
+inline bool CBlas<float>::gemm(float alpha, const MatView<const float> &A, Operation opA,
+                               const MatView<const float> &B, Operation opB, float beta,
+                               const MatView<float> &C)
+{
+    return cblasGemm(cblas_sgemm, alpha, A, opA, B, opB, beta, C);
+}
+
+template<>
+inline bool CBlas<double>::gemm(double alpha, const MatView<const double> &A, Operation opA,
+                                const MatView<const double> &B, Operation opB, double beta,
+                                const MatView<double> &C)
+{
+    return cblasGemm(cblas_dgemm, alpha, A, opA, B, opB, beta, C);
+}
+#endif
+
+/*
+    C = alpha * op(A) * op(B) + beta * C, op is NORMAL or TRANSPOSE.
+    C is caller owned and must have the result shape, transposes are never formed.
+    beta = 0 does not read C.
+    Built with USE_CBLAS large float and double products go to the system blas.
+    A and B are views of T or const T, so blocks of a batch need no copy.
+*/
+template <typename T, typename TA, typename TB>
+void gemm(T alpha, const MatView<TA> &A, Operation opA, const MatView<TB> &B, Operation opB,
+          T beta, const MatView<T> &C)
+{
+    int m = opA == NORMAL ? A.rows : A.cols;
+    int p = opA == NORMAL ? A.cols : A.rows;
+    int q = opB == NORMAL ? B.rows : B.cols;
+    int n = opB == NORMAL ? B.cols : B.rows;
+    if (p != q || C.rows != m || C.cols != n) {
+        std::cout<<"gemm size is not matched"<<std::endl;
+        return;
+    }
+#ifdef USE_CBLAS
+    if (CBlas<T>::gemm(alpha, MatView<const T>(A), opA, MatView<const T>(B), opB, beta, C)) {
+        return;
+    }
+#endif
+    return gemmKernel<T>(alpha, A, opA, B, opB, beta, C);
+}
+
+template <typename T>
+void gemm(T alpha, const Mat<T> &A, Operation opA, const Mat<T> &B, Operation opB, T beta, Mat<T> &C)
+{
+    return gemm(alpha, A.view(), opA, B.view(), opB, beta, C.view());
+}
+
+/* operand forms as template arguments, the form shared with StaticMat */
+template <Operation opA, Operation opB, typename T>
+void gemm(T alpha, const Mat<T> &A, const Mat<T> &B, T beta, Mat<T> &C)
+{
+    return gemm(alpha, A, opA, B, opB, beta, C);
+}
+
+/* y = x1^T * x2 */
+template <typename T>
+Mat<T> TrMul(const Mat<T> &x1, const Mat<T> &x2)
+{
+    Mat<T> y(x1.cols, x2.cols);
+    gemm(T(1), x1, TRANSPOSE, x2, NORMAL, T(0), y);
+    return y;
+}
+
+/* y = x1 * x2^T */
+template <typename T>
+Mat<T> MulTr(const Mat<T> &x1, const Mat<T> &x2)
+{
+    Mat<T> y(x1.rows, x2.rows);
+    gemm(T(1), x1, NORMAL, x2, TRANSPOSE, T(0), y);
+    return y;
+}
+
+/* y += x1 * x2^T, outer product when x1 and x2 are columns */
+template<typename T>
+void accumulateOuter(Mat<T> &y, const Mat<T> &x1, const Mat<T> &x2)
+{
+    return gemm(T(1), x1, NORMAL, x2, TRANSPOSE, T(1), y);
+}
+
+template <typename T>
+/* exp only sees -|x|, so large inputs do not overflow to inf / inf */
+inline T sigmoid(T x)
+{
+    if (x >= 0) {
+        return 1 / (1 + std::exp(-x));
+    }
+    T e = std::exp(x);
+    return e / (1 + e);
+}
+template <typename T>
+inline T relu(T x){return x > 0 ? x : 0;}
+template <typename T>
+inline T linear(T x){return x;}
+template <typename T>
+inline T dsigmoid(T y){return y * (1 - y);}
+template <typename T>
+inline T drelu(T y){return y > 0 ? 1 : 0;}
+template <typename T>
+inline T dtanh(T y){return 1 - y * y;}
 template <typename T>
-Mat<T> LOG(const Mat<T> &x){return for_each(x, static_cast<double(*)(double)>(log));}
+inline T dlinear(T){return 1;}
 template <typename T>
-Mat<T> EXP(const Mat<T> &x){return for_each(x, static_cast<double(*)(double)>(exp));}
+Mat<T> LOG(const Mat<T> &x){return for_each(x, [](typename Accumulate<T>::type v){return std::log(v);});}
 template <typename T>
-Mat<T> SQRT(const Mat<T> &x){return for_each(x, static_cast<double(*)(double)>(sqrt));}
+Mat<T> EXP(const Mat<T> &x){return for_each(x, [](typename Accumulate<T>::type v){return std::exp(v);});}
+template <typename T>
+Mat<T> SQRT(const Mat<T> &x){return for_each(x, [](typename Accumulate<T>::type v){return std::sqrt(v);});}
 
+/* activations accept Mat or any matrix type with a for_each overload */
 template <typename T>
 class Sigmoid {
 public:
-    static Mat<T> _(const Mat<T> &x){return for_each(x, sigmoid);}
-    static Mat<T> d(const Mat<T> &y){return for_each(y, dsigmoid);}
+    using A = typename Accumulate<T>::type;
+    template <typename TMat>
+    static TMat _(const TMat &x){return for_each(x, sigmoid<A>);}
+    template <typename TMat>
+    static TMat d(const TMat &y){return for_each(y, dsigmoid<A>);}
 };
 template <typename T>
 class Relu {
 public:
-    static Mat<T> _(const Mat<T> &x){return for_each(x, relu);}
-    static Mat<T> d(const Mat<T> &y){return for_each(y, drelu);}
+    using A = typename Accumulate<T>::type;
+    template <typename TMat>
+    static TMat _(const TMat &x){return for_each(x, relu<A>);}
+    template <typename TMat>
+    static TMat d(const TMat &y){return for_each(y, drelu<A>);}
 };
 template <typename T>
 class Tanh {
 public:
-    static Mat<T> _(const Mat<T> &x){return for_each(x, static_cast<double(*)(double)>(tanh));}
-    static Mat<T> d(const Mat<T> &y){return for_each(y, dtanh);}
+    using A = typename Accumulate<T>::type;
+    template <typename TMat>
+    static TMat _(const TMat &x){return for_each(x, [](A v){return std::tanh(v);});}
+    template <typename TMat>
+    static TMat d(const TMat &y){return for_each(y, dtanh<A>);}
 };
 template <typename T>
 class Linear {
 public:
-    static Mat<T> _(const Mat<T> &x){return x;}
-    static Mat<T> d(const Mat<T> &x){Mat<T> y(x); y.assign(1); return y;}
+    template <typename TMat>
+    static TMat _(const TMat &x){return x;}
+    template <typename TMat>
+    static TMat d(const TMat &x){TMat y(x); y.assign(1); return y;}
 };
 
+/*
+    softmax of every column (one sample per column), y may be x.
+    rows are walked in order so the column loops run over contiguous memory.
+*/
+template <typename T>
+void softmax(const Mat<T> &x, Mat<T> &y)
+{
+    using A = typename Accumulate<T>::type;
+    if (!y.isShapeEqual(x)) {
+        y.create(x.rows, x.cols);
+    }
+    Mat<T> maxT = columnMax(x);
+    std::vector<A> maxValue(maxT.data[0].begin(), maxT.data[0].end());
+    std::vector<A> s(x.cols, 0);
+    for (int i = 0; i < x.rows; i++) {
+        for (int j = 0; j < x.cols; j++) {
+            A e = std::exp(A(x.data[i][j]) - maxValue[j]);
+            y.data[i][j] = e;
+            s[j] += e;
+        }
+    }
+    /* the largest term is exp(0), s >= 1 */
+    for (int j = 0; j < x.cols; j++) {
+        s[j] = 1 / s[j];
+    }
+    for (int i = 0; i < y.rows; i++) {
+        for (int j = 0; j < y.cols; j++) {
+            y.data[i][j] = A(y.data[i][j]) * s[j];
+        }
+    }
+    return;
+}
+
+template <typename T>
+Mat<T> SOFTMAX(const Mat<T> &x)
+{
+    Mat<T> y;
+    softmax(x, y);
+    return y;
+}
+
+/*
+    fused log-softmax and cross entropy over the logits x, one sample per column.
+    loss = sum(label * (logsumexp(x) - x)) never takes the log of a probability,
+    prob = softmax(x) and dx = sum(label) * prob - label, which is prob - label for
+    a label column that sums to 1. returns the mean loss over the columns, but dx is
+    the gradient of the summed loss, one error per sample like the other outputs.
+    the logits are read twice.
+*/
 template <typename T>
-Mat<T> SOFTMAX(Mat<T>& x)
+T softmaxCrossEntropy(const Mat<T> &x, const Mat<T> &label, Mat<T> &prob, Mat<T> &dx)
 {
-    T maxValue = max(x);
-    Mat<T> delta = EXP(x - maxValue);
-    T s = sum(delta);
-    return delta / (s + 1e-9);
+    using A = typename Accumulate<T>::type;
+    if (!x.isShapeEqual(label)) {
+        std::cout<<"softmaxCrossEntropy size is not matched"<<std::endl;
+        return 0;
+    }
+    if (!prob.isShapeEqual(x)) {
+        prob.create(x.rows, x.cols);
+    }
+    if (!dx.isShapeEqual(x)) {
+        dx.create(x.rows, x.cols);
+    }
+    /* pass 1: max of every column */
+    Mat<T> maxT = columnMax(x);
+    std::vector<A> maxValue(maxT.data[0].begin(), maxT.data[0].end());
+    /* pass 2: exponentials, their sum, sum(label * x) and sum(label) */
+    std::vector<A> s(x.cols, 0);
+    std::vector<A> labelDot(x.cols, 0);
+    std::vector<A> labelSum(x.cols, 0);
+    for (int i = 0; i < x.rows; i++) {
+        for (int j = 0; j < x.cols; j++) {
+            A xi = x.data[i][j];
+            A li = label.data[i][j];
+            A e = std::exp(xi - maxValue[j]);
+            prob.data[i][j] = e;
+            s[j] += e;
+            labelDot[j] += li * xi;
+            labelSum[j] += li;
+        }
+    }
+    A loss = 0;
+    for (int j = 0; j < x.cols; j++) {
+        A logZ = maxValue[j] + std::log(s[j]);
+        loss += labelSum[j] * logZ - labelDot[j];
+        s[j] = 1 / s[j];
+    }
+    for (int i = 0; i < x.rows; i++) {
+        for (int j = 0; j < x.cols; j++) {
+            A p = A(prob.data[i][j]) * s[j];
+            prob.data[i][j] = p;
+            dx.data[i][j] = labelSum[j] * p - A(label.data[i][j]);
+        }
+    }
+    return loss / x.cols;
 }
 
 
@@ -6,25 +6,51 @@
 #include <vector>
 #include <functional>
 #include <map>
+#include <algorithm>
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
 #include "matrix.hpp"
 #include "graph.hpp"
+#include "sparse.hpp"
+#include "threadpool.hpp"
+#include "planner.hpp"
+#include "profiler.hpp"
 using namespace ML;
 
 /* loss type */
 enum LossType {
     MSE = 0,
-    CROSS_ENTROPY
+    CROSS_ENTROPY,
+    /* cross entropy over the target and sampled classes while training, full softmax otherwise */
+    SAMPLED_SOFTMAX
 };
+/* losses whose layer activation is a softmax */
+inline bool isSoftmax(LossType lossType)
+{
+    return lossType == CROSS_ENTROPY || lossType == SAMPLED_SOFTMAX;
+}
 /* layer type */
 enum LayerType {
   INPUT = 0,
   HIDDEN,
-  OUTPUT
+  OUTPUT,
+  /* input layer whose input holds ids, W[0] is the table of inputDim rows of layerDim */
+  EMBEDDING
 };
+/* layers fed by the input instead of other layers */
+inline bool isInput(LayerType layerType)
+{
+    return layerType == INPUT || layerType == EMBEDDING;
+}
 
+/*
+    weights of a layer are stored in a dense vector aligned with its predecessor
+    list: W[k] connects previous[k], an input layer only has W[0].
+    optimizers keep their state in the same order.
+    the overload with rows updates only those rows of every W[k] (a lazy update:
+    the state of the other rows is not decayed), B is always updated.
+*/
 template <typename T>
 class NoneOpt
 {
@@ -33,19 +59,16 @@ public:
     NoneOpt(const NoneOpt &){}
     NoneOpt& operator=(const NoneOpt &){return *this;}
     NoneOpt(LayerType , int , int ){}
-    void connect(int , int , int){}
-    void _(const std::vector<int> &,
-           LayerType ,
-           T ,
-           std::map<int, Mat<T> > &,
-           Mat<T> &){}
+    void connect(int , int){}
+    void _(T , std::vector<Mat<T> > &, Mat<T> &){}
+    void _(T , std::vector<Mat<T> > &, Mat<T> &, const std::vector<int> &){}
 };
 
 template <typename T>
 class SGD
 {
 public:
-   std::map<int, Mat<T> > dW;
+   std::vector<Mat<T> > dW;
    Mat<T> dB;
    Mat<T> E;
 public:
@@ -65,29 +88,36 @@ public:
     SGD(LayerType layerType, int layerDim, int inputDim)
     {
         if (layerType == INPUT) {
-            dW[0] = Mat<T>(layerDim, inputDim);
+            dW.push_back(Mat<T>(layerDim, inputDim));
         }
         E = Mat<T>(layerDim, 1);
         dB = Mat<T>(layerDim, 1);
     }
-    void connect(int from, int layerDim, int inputDim)
+    void connect(int layerDim, int inputDim)
     {
-        dW[from] = Mat<T>(layerDim, inputDim);
+        dW.push_back(Mat<T>(layerDim, inputDim));
         return;
     }
-    void _(const std::vector<int> &previous,
-           LayerType layerType,
-           T learningRate,
-           std::map<int, Mat<T> > &W,
-           Mat<T> &B)
+    void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B)
     {
-        if (layerType == INPUT) {
-            W[0] -= dW[0] * learningRate;
-            dW[0].zero();
-        } else {
-            for (int from : previous) {
-                W[from] -= dW[from] * learningRate;
-                dW[from].zero();
+        for (std::size_t k = 0; k < W.size(); k++) {
+            W[k] -= dW[k] * learningRate;
+            dW[k].zero();
+        }
+        B -= dB * learningRate;
+        dB.zero();
+        return;
+    }
+    void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B, const std::vector<int> &rows)
+    {
+        for (std::size_t k = 0; k < W.size(); k++) {
+            for (int r : rows) {
+                std::vector<T> &w = W[k].data[r];
+                std::vector<T> &dw = dW[k].data[r];
+                for (std::size_t i = 0; i < w.size(); i++) {
+                    w[i] -= dw[i] * learningRate;
+                    dw[i] = 0;
+                }
             }
         }
         B -= dB * learningRate;
@@ -102,10 +132,10 @@ class RMSProp
 public:
      static T rho;
 public:
-    std::map<int, Mat<T> > dW;
+    std::vector<Mat<T> > dW;
     Mat<T> dB;
     Mat<T> E;
-    std::map<int, Mat<T> > Sw;
+    std::vector<Mat<T> > Sw;
     Mat<T> Sb;
 public:
     RMSProp(){}
@@ -128,35 +158,44 @@ public:
     RMSProp(LayerType layerType, int layerDim, int inputDim)
     {
         if (layerType == INPUT) {
-            dW[0] = Mat<T>(layerDim, inputDim);
-            Sw[0] = Mat<T>(layerDim, inputDim);
+            dW.push_back(Mat<T>(layerDim, inputDim));
+            Sw.push_back(Mat<T>(layerDim, inputDim));
         }
         E = Mat<T>(layerDim, 1);
         dB = Mat<T>(layerDim, 1);
         Sb = Mat<T>(layerDim, 1);
         return;
     }
-    void connect(int from, int layerDim, int inputDim)
+    void connect(int layerDim, int inputDim)
     {
-        dW[from] = Mat<T>(layerDim, inputDim);
-        Sw[from] = Mat<T>(layerDim, inputDim);
+        dW.push_back(Mat<T>(layerDim, inputDim));
+        Sw.push_back(Mat<T>(layerDim, inputDim));
         return;
     }
-    void _(const std::vector<int> &previous,
-           LayerType layerType,
-           T learningRate,
-           std::map<int, Mat<T> > &W,
-           Mat<T> &B)
+    void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B)
     {
-        if (layerType == INPUT) {
-            Sw[0] = Sw[0] * rho + (dW[0] % dW[0]) * (1 - rho);
-            W[0] -= dW[0] / (SQRT(Sw[0]) + 1e-9) * learningRate;
-            dW[0].zero();
-        } else {
-            for (int from : previous) {
-                Sw[from] = Sw[from] * rho + (dW[from] % dW[from]) * (1 - rho);
-                W[from] -= dW[from] / (SQRT(Sw[from]) + 1e-9) * learningRate;
-                dW[from].zero();
+        for (std::size_t k = 0; k < W.size(); k++) {
+            Sw[k] = Sw[k] * rho + (dW[k] % dW[k]) * (1 - rho);
+            W[k] -= dW[k] / (SQRT(Sw[k]) + 1e-9) * learningRate;
+            dW[k].zero();
+        }
+        Sb = Sb * rho + (dB % dB) * (1 - rho);
+        B -= dB / (SQRT(Sb) + 1e-9)* learningRate;
+        dB.zero();
+        return;
+    }
+    void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B, const std::vector<int> &rows)
+    {
+        for (std::size_t k = 0; k < W.size(); k++) {
+            for (int r : rows) {
+                std::vector<T> &w = W[k].data[r];
+                std::vector<T> &dw = dW[k].data[r];
+                std::vector<T> &sw = Sw[k].data[r];
+                for (std::size_t i = 0; i < w.size(); i++) {
+                    sw[i] = sw[i] * rho + dw[i] * dw[i] * (1 - rho);
+                    w[i] -= dw[i] / (std::sqrt(sw[i]) + T(1e-9)) * learningRate;
+                    dw[i] = 0;
+                }
             }
         }
         Sb = Sb * rho + (dB % dB) * (1 - rho);
@@ -175,12 +214,12 @@ public:
     static T alpha1Factor;
     static T alpha2Factor;
 public:
-    std::map<int, Mat<T> > dW;
+    std::vector<Mat<T> > dW;
     Mat<T> dB;
     Mat<T> E;
-    std::map<int, Mat<T> > Sw;
+    std::vector<Mat<T> > Sw;
     Mat<T> Sb;
-    std::map<int, Mat<T> > Vw;
+    std::vector<Mat<T> > Vw;
     Mat<T> Vb;
     T alpha1;
     T alpha2;
@@ -209,9 +248,9 @@ public:
     Adam(LayerType layerType, int layerDim, int inputDim):alpha1(1), alpha2(1)
     {
         if (layerType == INPUT) {
-            dW[0] = Mat<T>(layerDim, inputDim);
-            Sw[0] = Mat<T>(layerDim, inputDim);
-            Vw[0] = Mat<T>(layerDim, inputDim);
+            dW.push_back(Mat<T>(layerDim, inputDim));
+            Sw.push_back(Mat<T>(layerDim, inputDim));
+            Vw.push_back(Mat<T>(layerDim, inputDim));
         }
         E = Mat<T>(layerDim, 1);
         dB = Mat<T>(layerDim, 1);
@@ -219,37 +258,52 @@ public:
         Vb = Mat<T>(layerDim, 1);
         return;
     }
-    void connect(int from, int layerDim, int inputDim)
+    void connect(int layerDim, int inputDim)
     {
-        dW[from] = Mat<T>(layerDim, inputDim);
-        Sw[from] = Mat<T>(layerDim, inputDim);
-        Vw[from] = Mat<T>(layerDim, inputDim);
+        dW.push_back(Mat<T>(layerDim, inputDim));
+        Sw.push_back(Mat<T>(layerDim, inputDim));
+        Vw.push_back(Mat<T>(layerDim, inputDim));
         return;
     }
 
-    void _(const std::vector<int> &previous,
-           LayerType layerType,
-           T learningRate,
-           std::map<int, Mat<T> > &W,
-           Mat<T> &B)
+    void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B)
     {
         alpha1 *= alpha1Factor;
         alpha2 *= alpha2Factor;
-        if (layerType == INPUT) {
-            Vw[0] = Vw[0] * alpha1Factor + dW[0] * (1 - alpha1Factor);
-            Sw[0] = Sw[0] * alpha2Factor + (dW[0] % dW[0]) * (1 - alpha2Factor);
-            Mat<T> Vwt = Vw[0] / (1 - alpha1);
-            Mat<T> Swt = Sw[0] / (1 - alpha2);
-            W[0] -= Vwt / (SQRT(Swt) + 1e-9) * learningRate;
-            dW[0].zero();
-        } else {
-            for (int from : previous) {
-                Vw[from] = Vw[from] * alpha1Factor + dW[from] * (1 - alpha1Factor);
-                Sw[from] = Sw[from] * alpha2Factor + (dW[from] % dW[from]) * (1 - alpha2Factor);
-                Mat<T> Vwt = Vw[from] / (1 - alpha1);
-                Mat<T> Swt = Sw[from] / (1 - alpha2);
-                W[from] -= Vwt / (SQRT(Swt) + 1e-9) * learningRate;
-                dW[from].zero();
+        for (std::size_t k = 0; k < W.size(); k++) {
+            Vw[k] = Vw[k] * alpha1Factor + dW[k] * (1 - alpha1Factor);
+            Sw[k] = Sw[k] * alpha2Factor + (dW[k] % dW[k]) * (1 - alpha2Factor);
+            Mat<T> Vwt = Vw[k] / (1 - alpha1);
+            Mat<T> Swt = Sw[k] / (1 - alpha2);
+            W[k] -= Vwt / (SQRT(Swt) + 1e-9) * learningRate;
+            dW[k].zero();
+        }
+        Vb = Vb * alpha1Factor + dB * (1 - alpha1Factor);
+        Sb = Sb * alpha2Factor + (dB % dB) * (1 - alpha2Factor);
+        Mat<T> Vbt = Vb / (1 - alpha1);
+        Mat<T> Sbt = Sb / (1 - alpha2);
+        B -= Vbt / (SQRT(Sbt) + 1e-9) * learningRate;
+        dB.zero();
+        return;
+    }
+    void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B, const std::vector<int> &rows)
+    {
+        alpha1 *= alpha1Factor;
+        alpha2 *= alpha2Factor;
+        for (std::size_t k = 0; k < W.size(); k++) {
+            for (int r : rows) {
+                std::vector<T> &w = W[k].data[r];
+                std::vector<T> &dw = dW[k].data[r];
+                std::vector<T> &vw = Vw[k].data[r];
+                std::vector<T> &sw = Sw[k].data[r];
+                for (std::size_t i = 0; i < w.size(); i++) {
+                    vw[i] = vw[i] * alpha1Factor + dw[i] * (1 - alpha1Factor);
+                    sw[i] = sw[i] * alpha2Factor + dw[i] * dw[i] * (1 - alpha2Factor);
+                    T vt = vw[i] / (1 - alpha1);
+                    T st = sw[i] / (1 - alpha2);
+                    w[i] -= vt / (std::sqrt(st) + T(1e-9)) * learningRate;
+                    dw[i] = 0;
+                }
             }
         }
         Vb = Vb * alpha1Factor + dB * (1 - alpha1Factor);
@@ -266,11 +320,184 @@ T Adam<T>::alpha1Factor(0.9);
 template<typename T>
 T Adam<T>::alpha2Factor(0.99);
 
+/* low precision gradients with float master weights and optimizer state */
+template <template<typename> class OptimizeF>
+class Master
+{
+public:
+    template <typename T>
+    class Optimizer
+    {
+    public:
+        std::vector<Mat<T> > dW;
+        Mat<T> dB;
+        Mat<T> E;
+        OptimizeF<float> opt;
+        std::vector<Mat<float> > masterW;
+        Mat<float> masterB;
+    public:
+        Optimizer(){}
+        Optimizer(LayerType layerType, int layerDim, int inputDim):
+            opt(layerType, layerDim, inputDim)
+        {
+            if (layerType == INPUT) {
+                dW.push_back(Mat<T>(layerDim, inputDim));
+            }
+            E = Mat<T>(layerDim, 1);
+            dB = Mat<T>(layerDim, 1);
+        }
+        void connect(int layerDim, int inputDim)
+        {
+            dW.push_back(Mat<T>(layerDim, inputDim));
+            return opt.connect(layerDim, inputDim);
+        }
+        void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B)
+        {
+            if (masterB.isNull()) {
+                for (auto &w : W) {
+                    masterW.push_back(cast<float>(w));
+                }
+                masterB = cast<float>(B);
+            }
+            for (std::size_t k = 0; k < dW.size(); k++) {
+                opt.dW[k] = cast<float>(dW[k]);
+                dW[k].zero();
+            }
+            opt.dB = cast<float>(dB);
+            dB.zero();
+            opt._(float(learningRate), masterW, masterB);
+            for (std::size_t k = 0; k < W.size(); k++) {
+                W[k] = cast<T>(masterW[k]);
+            }
+            B = cast<T>(masterB);
+            return;
+        }
+        void _(T learningRate, std::vector<Mat<T> > &W, Mat<T> &B, const std::vector<int> &rows)
+        {
+            if (masterB.isNull()) {
+                for (auto &w : W) {
+                    masterW.push_back(cast<float>(w));
+                }
+                masterB = cast<float>(B);
+            }
+            for (std::size_t k = 0; k < dW.size(); k++) {
+                for (int r : rows) {
+                    convert(dW[k].data[r].data(), opt.dW[k].data[r].data(), dW[k].cols);
+                    std::fill(dW[k].data[r].begin(), dW[k].data[r].end(), T(0));
+                }
+            }
+            opt.dB = cast<float>(dB);
+            dB.zero();
+            opt._(float(learningRate), masterW, masterB, rows);
+            for (std::size_t k = 0; k < W.size(); k++) {
+                for (int r : rows) {
+                    convert(masterW[k].data[r].data(), W[k].data[r].data(), W[k].cols);
+                }
+            }
+            B = cast<T>(masterB);
+            return;
+        }
+    };
+};
+
+/* dynamic loss scaling, keeps small low precision gradients from flushing to zero */
+class LossScaler
+{
+public:
+    bool enabled;
+    float scale;
+    /* growth stops here, 2^24 */
+    float maxScale;
+    int growthInterval;
+    int goodSteps;
+public:
+    LossScaler():enabled(false), scale(1), maxScale(16777216), growthInterval(2000), goodSteps(0){}
+    LossScaler(float scale_, int growthInterval_):
+        enabled(true), scale(scale_), maxScale(16777216), growthInterval(growthInterval_), goodSteps(0){}
+    inline bool isEnabled() const {return enabled;}
+    void update(bool overflow)
+    {
+        if (overflow) {
+            scale = scale / 2 < 1 ? 1 : scale / 2;
+            goodSteps = 0;
+        } else if (++goodSteps >= growthInterval) {
+            scale = scale * 2 > maxScale ? maxScale : scale * 2;
+            goodSteps = 0;
+        }
+        return;
+    }
+};
+
+/*
+    negative classes of sampled softmax. the log-uniform (Zipfian) distribution
+    expects class ids sorted by decreasing frequency, otherwise use uniform.
+*/
+class CandidateSampler
+{
+public:
+    int sampleNum;
+    bool logUniform;
+public:
+    CandidateSampler():sampleNum(64), logUniform(true){}
+    CandidateSampler(int sampleNum_, bool logUniform_):
+        sampleNum(sampleNum_), logUniform(logUniform_){}
+    /* probability to draw class c out of n */
+    inline double probability(int c, int n) const
+    {
+        if (!logUniform) {
+            return 1.0 / n;
+        }
+        return std::log((c + 2.0) / (c + 1.0)) / std::log(n + 1.0);
+    }
+    /* log of the expected count of class c in one sample set, subtracted from its logit */
+    inline double logQ(int c, int n) const
+    {
+        return std::log(sampleNum * probability(c, n));
+    }
+    inline int draw(int n) const
+    {
+        double u = Random::unit();
+        if (!logUniform) {
+            return int(u * n);
+        }
+        int c = int(std::exp(u * std::log(n + 1.0))) - 1;
+        return c < n ? c : n - 1;
+    }
+    /* append up to sampleNum distinct classes of n that are not in candidates yet */
+    void sample(int n, std::vector<int> &candidates) const
+    {
+        int num = std::min(sampleNum, n - int(candidates.size()));
+        int added = 0;
+        for (int i = 0; added < num && i < 16 * sampleNum; i++) {
+            int c = draw(n);
+            if (std::find(candidates.begin(), candidates.end(), c) == candidates.end()) {
+                candidates.push_back(c);
+                added++;
+            }
+        }
+        return;
+    }
+};
+
 template <typename T, template<typename> class OptimizeF>
 class Layer : public OptimizeF<T>
 {
 public:
-    std::map<int, Mat<T> > W;
+    /* W[k] connects the k-th previous layer, W[0] is the input weight of an input layer */
+    std::vector<Mat<T> > W;
+    /* pruned weights in the same order, used instead of W when present */
+    std::vector<SparseMat<T> > SW;
+    /* [W[0] W[1] ...] for one GEMM over all edges, and its stacked input */
+    Mat<T> Wc;
+    Mat<T> X;
+    /* scratch for the packed gradient, not copied */
+    Mat<T> dWc;
+    /* sampled softmax: classes of the last backward pass and the error of their logits, not copied */
+    std::vector<int> candidates;
+    Mat<T> Ec;
+    /* rows of W with a gradient since the last optimize, embedding and sampled softmax layers update only these */
+    std::vector<int> sparseRows;
+    std::vector<char> rowMark;
     Mat<T> B;
     Mat<T> O;
     /* paramter */
@@ -284,6 +511,11 @@ public:
     Layer(const Layer& layer):
         OptimizeF<T>(layer),
         W(layer.W),
+        SW(layer.SW),
+        Wc(layer.Wc),
+        X(layer.X),
+        sparseRows(layer.sparseRows),
+        rowMark(layer.rowMark),
         B(layer.B),
         O(layer.O),
         layerDim(layer.layerDim),
@@ -296,6 +528,13 @@ public:
             return *this;
         }
         W = layer.W;
+        SW = layer.SW;
+        Wc.create(layer.Wc.rows, layer.Wc.cols);
+        Wc = layer.Wc;
+        X.create(layer.X.rows, layer.X.cols);
+        X = layer.X;
+        sparseRows = layer.sparseRows;
+        rowMark = layer.rowMark;
         B = layer.B;
         O = layer.O;
         /* paramter */
@@ -323,20 +562,213 @@ public:
         this->inputDim = inputDim;
         this->lossType = lossType;
         this->layerType = layerType;
-        W[0] = Mat<T>(layerDim, inputDim, UNIFORM_RAND);
+        if (layerType == EMBEDDING) {
+            /* one row per id, the optimizer state follows the table shape */
+            W.push_back(Mat<T>(inputDim, layerDim, UNIFORM_RAND));
+            OptimizeF<T>::connect(inputDim, layerDim);
+        } else {
+            W.push_back(Mat<T>(layerDim, inputDim, UNIFORM_RAND));
+        }
         B = Mat<T>(layerDim, 1, UNIFORM_RAND);
         O = Mat<T>(layerDim, 1);
     }
 
-    void connect(int from, int inputDim_)
+    /* edges must be connected in the order of the predecessor list */
+    void connect(int inputDim_)
     {
         this->inputDim = inputDim_;
-        W[from] = Mat<T>(layerDim, inputDim, UNIFORM_RAND);
-        return OptimizeF<T>::connect(from, layerDim, inputDim);
+        W.push_back(Mat<T>(layerDim, inputDim, UNIFORM_RAND));
+        return OptimizeF<T>::connect(layerDim, inputDim);
+    }
+    void optimize(T learningRate)
+    {
+        if (isRowSparse()) {
+            OptimizeF<T>::_(learningRate, W, B, sparseRows);
+            for (int r : sparseRows) {
+                rowMark[r] = 0;
+            }
+            sparseRows.clear();
+        } else {
+            OptimizeF<T>::_(learningRate, W, B);
+        }
+        /* keep the pruned pattern */
+        for (std::size_t k = 0; k < SW.size(); k++) {
+            SW[k].gather(W[k]);
+            W[k] = SW[k].toDense();
+        }
+        if (isPacked()) {
+            pack();
+        }
+        return;
+    }
+    inline bool isPacked() const {return !Wc.isNull();}
+    inline bool isRowSparse() const {return layerType == EMBEDDING || lossType == SAMPLED_SOFTMAX;}
+    inline void markRow(int r)
+    {
+        if (rowMark.empty()) {
+            rowMark = std::vector<char>(W[0].rows, 0);
+        }
+        if (!rowMark[r]) {
+            rowMark[r] = 1;
+            sparseRows.push_back(r);
+        }
+        return;
+    }
+    inline bool isValidId(int id) const
+    {
+        if (id >= W[0].rows) {
+            std::cout<<"embedding id is out of range: "<<id<<std::endl;
+            return false;
+        }
+        return id >= 0;
+    }
+    /*
+        embedding lookup: column j of the output sums the table rows of the ids
+        in column j of x, negative ids are padding.
+        a sparse x holds weights of ids, (inputDim, batch), like a one-hot input.
+    */
+    Mat<T> embed(const Mat<T> &x) const
+    {
+        Mat<T> y(layerDim, x.cols);
+        for (int i = 0; i < x.rows; i++) {
+            for (int j = 0; j < x.cols; j++) {
+                int id = int(x.data[i][j]);
+                if (!isValidId(id)) {
+                    continue;
+                }
+                const std::vector<T> &w = W[0].data[id];
+                for (int r = 0; r < layerDim; r++) {
+                    y.data[r][j] += w[r];
+                }
+            }
+        }
+        return y;
+    }
+    Mat<T> embed(const SparseMat<T> &x) const
+    {
+        Mat<T> y(layerDim, x.cols);
+        for (int i = 0; i < x.majorSize(); i++) {
+            for (int p = x.offsets[i]; p < x.offsets[i + 1]; p++) {
+                int id = x.format == CSR ? i : x.indices[p];
+                int j = x.format == CSR ? x.indices[p] : i;
+                if (!isValidId(id)) {
+                    continue;
+                }
+                const std::vector<T> &w = W[0].data[id];
+                for (int r = 0; r < layerDim; r++) {
+                    y.data[r][j] += w[r] * x.values[p];
+                }
+            }
+        }
+        return y;
+    }
+    /* scatter dy into the rows of dW[0] of the ids of x */
+    void accumulateEmbedding(const Mat<T> &dy, const Mat<T> &x)
+    {
+        for (int i = 0; i < x.rows; i++) {
+            for (int j = 0; j < x.cols; j++) {
+                int id = int(x.data[i][j]);
+                if (!isValidId(id)) {
+                    continue;
+                }
+                std::vector<T> &dw = this->dW[0].data[id];
+                for (int r = 0; r < layerDim; r++) {
+                    dw[r] += dy.data[r][j];
+                }
+                markRow(id);
+            }
+        }
+        return;
+    }
+    void accumulateEmbedding(const Mat<T> &dy, const SparseMat<T> &x)
+    {
+        for (int i = 0; i < x.majorSize(); i++) {
+            for (int p = x.offsets[i]; p < x.offsets[i + 1]; p++) {
+                int id = x.format == CSR ? i : x.indices[p];
+                int j = x.format == CSR ? x.indices[p] : i;
+                if (!isValidId(id)) {
+                    continue;
+                }
+                std::vector<T> &dw = this->dW[0].data[id];
+                for (int r = 0; r < layerDim; r++) {
+                    dw[r] += dy.data[r][j] * x.values[p];
+                }
+                markRow(id);
+            }
+        }
+        return;
     }
-    void optimize(const std::vector<int> &previous, T learningRate)
+    /* number of weights, for flop and byte counts */
+    inline double weightSize() const
     {
-        return OptimizeF<T>::_(previous, layerType, learningRate, W, B);
+        double n = 0;
+        for (auto &w : W) {
+            n += double(w.rows) * w.cols;
+        }
+        return n;
+    }
+    /* copy W into the concatenated weight */
+    void pack()
+    {
+        int cols = 0;
+        for (auto &w : W) {
+            cols += w.cols;
+        }
+        if (Wc.rows != layerDim || Wc.cols != cols) {
+            Wc.create(layerDim, cols);
+        }
+        int offset = 0;
+        for (auto &w : W) {
+            Wc.set(0, offset, w);
+            offset += w.cols;
+        }
+        return;
+    }
+    void unpack()
+    {
+        Wc.create(0, 0);
+        X.create(0, 0);
+        return;
+    }
+    /* dW[k] += columns of dy * X^T that belong to edge k */
+    void accumulatePacked(const Mat<T> &dy)
+    {
+        if (dWc.rows != Wc.rows || dWc.cols != Wc.cols) {
+            dWc.create(Wc.rows, Wc.cols);
+        }
+        gemm(T(1), dy, NORMAL, X, TRANSPOSE, T(0), dWc);
+        int offset = 0;
+        for (auto &dw : this->dW) {
+            dw.view() += dWc.view(0, offset, dw.rows, dw.cols);
+            offset += dw.cols;
+        }
+        return;
+    }
+    void prune(double sparsity)
+    {
+        SW.clear();
+        for (auto &w : W) {
+            SW.push_back(ML::prune(w, sparsity));
+        }
+        return;
+    }
+    /* k is the slot of the edge in the predecessor list */
+    Mat<T> forward(int k, const Mat<T> &x) const
+    {
+        if (layerType == EMBEDDING) {
+            return embed(x);
+        }
+        if (!SW.empty()) {
+            return SW[k] * x;
+        }
+        return W[k] * x;
+    }
+    Mat<T> forward(int k, const SparseMat<T> &x) const
+    {
+        if (layerType == EMBEDDING) {
+            return embed(x);
+        }
+        return W[k] * x;
     }
 };
 
@@ -367,26 +799,39 @@ public:
     using GraphParams = std::vector<EdgeParam>;
     using DAG = Graph<Layer<T, OptimizeF> >;
     using Input = std::map<std::string, Mat<T> >;
+    using SparseInput = std::map<std::string, SparseMat<T> >;
+    /* inputs indexed by vertex id, see index() */
+    using IndexedInput = std::vector<Mat<T> >;
     using InputVec = std::vector<Input>;
     using Target = std::vector<Mat<T> >;
     using Targets = std::map<std::string, Mat<T> >;
+    using State = std::vector<Mat<T> >;
     using Flat = MLP<T, ActivateF, NoneOpt>;
+    using Activate = ActivateF<T>;
+public:
+    LossScaler scaler;
+    CandidateSampler sampler;
+    /* while training, feedForward skips the full softmax of sampled softmax layers */
+    bool training;
 public:
-    MLP(){}
+    MLP():training(false){}
     ~MLP(){}
-    MLP(const MLP& mlp):DAG(mlp){}
+    MLP(const MLP& mlp):DAG(mlp), scaler(mlp.scaler), sampler(mlp.sampler), training(mlp.training){}
     MLP& operator = (const MLP& mlp)
     {
         if (this == &mlp) {
             return *this;
         }
         DAG::operator=(mlp);
+        scaler = mlp.scaler;
+        sampler = mlp.sampler;
+        training = mlp.training;
         return *this;
     }
-    MLP(const LayerParams& layerParam, const GraphParams& graphParam)
+    MLP(const LayerParams& layerParam, const GraphParams& graphParam):training(false)
     {
         for (int i = 0; i < layerParam.size(); i++) {
-            if (layerParam[i].layerType == INPUT) {
+            if (isInput(layerParam[i].layerType)) {
                 DAG::insertVertex(TLayer(layerParam[i].layerType,
                                          layerParam[i].lossType,
                                          layerParam[i].layerDim,
@@ -432,7 +877,7 @@ public:
         }
         auto &layer = DAG::getObject(to);
         auto &preLayer = DAG::getObject(from);
-        layer.connect(from, preLayer.layerDim);
+        layer.connect(preLayer.layerDim);
         return DAG::insertEdge(from, to);
     }
 
@@ -442,7 +887,7 @@ public:
         /* copy vertexs */
         for (auto& x : DAG::vertexs) {
             auto& layer = x.object;
-            if (layer.layerType == INPUT) {
+            if (isInput(layer.layerType)) {
                 dst.addLayer(layer.layerType, layer.lossType, layer.layerDim, layer.inputDim, x.name);
             } else {
                 dst.addLayer(layer.layerType, layer.lossType, layer.layerDim ,x.name);
@@ -451,18 +896,22 @@ public:
         /* copy edges */
         for (int current : DAG::topologySequence) {
             auto &layer = dst.getObject(current);
-            if (layer.layerType != INPUT) {
-                for (int  from : DAG::previous.at(current)) {
+            if (!isInput(layer.layerType)) {
+                for (int  from : DAG::previous[current]) {
                     auto &preLayer = DAG::getObject(from);
-                    layer.connect(from, preLayer.layerDim);
+                    layer.connect(preLayer.layerDim);
                 }
             }
         }
         dst.edges = DAG::edges;
         dst.topologySequence = DAG::topologySequence;
         dst.traversalSequence = DAG::traversalSequence;
+        dst.levels = DAG::levels;
         dst.previous = DAG::previous;
         dst.nexts = DAG::nexts;
+        dst.outAdj = DAG::outAdj;
+        dst.inAdj = DAG::inAdj;
+        dst.outSlot = DAG::outSlot;
         /* copy data */
         copyTo(dst);
         return dst;
@@ -472,6 +921,10 @@ public:
     {
         for (int i = 0; i < DAG::vertexs.size(); i++) {
             dst.vertexs[i].object.W = DAG::vertexs[i].object.W;
+            dst.vertexs[i].object.SW = DAG::vertexs[i].object.SW;
+            if (DAG::vertexs[i].object.isPacked()) {
+                dst.vertexs[i].object.pack();
+            }
             dst.vertexs[i].object.B = DAG::vertexs[i].object.B;
         }
         return;
@@ -482,97 +935,580 @@ public:
         for (int  current : DAG::topologySequence) {
             auto &layer = DAG::getObject(current);
             auto &dstLayer = dst.getObject(current);
-            for (int  from : DAG::previous.at(current)) {
-                dstLayer.W[from] = dstLayer.W[from] * (1 - alpha) + layer.W[from] * alpha;
+            for (std::size_t k = 0; k < layer.W.size(); k++) {
+                dstLayer.W[k] = dstLayer.W[k] * (1 - alpha) + layer.W[k] * alpha;
             }
             dstLayer.B = dstLayer.B * (1 - alpha) + layer.B * alpha;
+            if (dstLayer.isPacked()) {
+                dstLayer.pack();
+            }
         }
         return;
     }
 
-    void feedForward(const Input &x)
+    /* input of a vertex, by name or by vertex id */
+    template<typename TMat>
+    inline const TMat& inputOf(const std::map<std::string, TMat> &x, int id) const
+    {
+        return x.at(DAG::vertexs[id].name);
+    }
+    template<typename TMat>
+    inline const TMat& inputOf(const std::vector<TMat> &x, int id) const
+    {
+        return x.at(id);
+    }
+
+    /* resolve input names once, the indexed form needs no lookup by name */
+    template<typename TMat>
+    std::vector<TMat> index(const std::map<std::string, TMat> &x) const
+    {
+        std::vector<TMat> y(DAG::vertexs.size());
+        for (auto &in : x) {
+            int id = DAG::findVertex(in.first);
+            if (id < 0) {
+                std::cout<<"invalid name"<<std::endl;
+                continue;
+            }
+            y[id] = in.second;
+        }
+        return y;
+    }
+
+    /*
+        layers with several predecessors run one GEMM on concatenated weights
+        and stacked inputs instead of one small GEMM per edge.
+        pruned layers keep their sparse kernels.
+    */
+    void pack()
+    {
+        for (auto &v : DAG::vertexs) {
+            auto &layer = v.object;
+            if (layer.layerType != INPUT && layer.W.size() > 1 && layer.SW.empty() &&
+                    layer.lossType != SAMPLED_SOFTMAX) {
+                layer.pack();
+            }
+        }
+        return;
+    }
+
+    void unpack()
+    {
+        for (auto &v : DAG::vertexs) {
+            v.object.unpack();
+        }
+        return;
+    }
+
+    /* stack outputOf(previous[k]) by rows into X */
+    template<typename F>
+    void packInput(int current, F outputOf, Mat<T> &X) const
+    {
+        const std::vector<int> &previous = DAG::previous[current];
+        int rows = 0;
+        for (int from : previous) {
+            rows += outputOf(from).rows;
+        }
+        int cols = outputOf(previous[0]).cols;
+        if (X.rows != rows || X.cols != cols) {
+            X.create(rows, cols);
+        }
+        int offset = 0;
+        for (int from : previous) {
+            const Mat<T> &o = outputOf(from);
+            for (int i = 0; i < o.rows; i++) {
+                X.data[offset + i] = o.data[i];
+            }
+            offset += o.rows;
+        }
+        return;
+    }
+
+    /* x is an Input, SparseInput or their indexed form */
+    template<typename TInput>
+    void feedForward(const TInput &x)
     {
         if (!DAG::isDAG()) {
             return;
         }
         for (int current : DAG::topologySequence) {
-            auto &layer = DAG::getObject(current);
-            if (layer.layerType == INPUT) {
-                layer.O = ActivateF<T>::_(layer.W[0] * x.at(DAG::vertexs[current].name) + layer.B);
+            forwardVertex(current, x);
+        }
+        return;
+    }
+
+    /* independent layers of a level run concurrently */
+    template<typename TInput>
+    void feedForward(const TInput &x, ThreadPool &pool)
+    {
+        if (!DAG::isDAG()) {
+            return;
+        }
+        for (auto &level : DAG::levels) {
+            pool.parallelFor(level.size(), [&](int i){forwardVertex(level[i], x);});
+        }
+        return;
+    }
+
+    template<typename TInput>
+    void forwardVertex(int current, const TInput &x)
+    {
+        auto &layer = DAG::getObject(current);
+        ML_PROFILE_SCOPE("forward", DAG::vertexs[current].name.c_str(),
+                         2 * layer.weightSize() * layer.O.cols, sizeof(T) * layer.weightSize());
+        if (isInput(layer.layerType)) {
+            layer.O = ActivateF<T>::_(layer.forward(0, inputOf(x, current)) + layer.B);
+        } else if (layer.lossType == SAMPLED_SOFTMAX && training) {
+            /* the logits of the sampled classes are computed by backwardVertex */
+            return;
+        } else {
+            Mat<T> s;
+            const std::vector<int> &previous = DAG::previous[current];
+            if (layer.isPacked()) {
+                packInput(current, [this](int i) -> const Mat<T>& {return DAG::getObject(i).O;}, layer.X);
+                s = layer.Wc * layer.X;
             } else {
-                Mat<T> s(layer.O.rows, layer.O.cols);
-                for (int from : DAG::previous[current]) {
-                    auto &preLayer = DAG::getObject(from);
-                    s += layer.W[from] * preLayer.O;
+                s.create(layer.O.rows, layer.O.cols);
+                for (std::size_t k = 0; k < previous.size(); k++) {
+                    auto &preLayer = DAG::getObject(previous[k]);
+                    s += layer.forward(k, preLayer.O);
                 }
-                s += layer.B;
+            }
+            s += layer.B;
+            /* softmax is the activation of a cross entropy layer */
+            if (isSoftmax(layer.lossType)) {
+                softmax(s, layer.O);
+            } else {
                 layer.O = ActivateF<T>::_(s);
-                if (layer.lossType == CROSS_ENTROPY) {
-                    layer.O = SOFTMAX(layer.O);
-                }
             }
         }
         return;
     }
 
-    void gradient(Input &x, Mat<T> &y)
+    /* read-only forward pass: activations are written to the caller's state,
+       so one model can be shared by many threads. each column of an input
+       is one sample. */
+    template<typename TInput>
+    void feedForward(const TInput &x, State &O) const
     {
         if (!DAG::isDAG()) {
             return;
         }
-        /* error backpropagate */
-        for (int i = DAG::topologySequence.size() - 1; i >= 0; i--) {
-            int current = DAG::topologySequence[i];
-            auto &layer = DAG::getObject(current);
-            if (layer.layerType == OUTPUT) {
-                /* calculate loss */
-                if (layer.lossType == CROSS_ENTROPY) {
-                    layer.E = (y % LOG(layer.O)) * (-1);
-                } else if (layer.lossType == MSE){
-                    layer.E = layer.O - y;
-                }
+        O.resize(DAG::vertexs.size());
+        return forwardState(x, O, [](int i){return i;});
+    }
+
+    /* the same with buffer reuse: activation of vertex i is O[plan.slotOf(i)],
+       the output is O[plan.slotOf(outputIndex())]. plan comes from plan(batchSize, false) */
+    template<typename TInput>
+    void feedForward(const TInput &x, State &O, const ML::MemoryPlan &plan) const
+    {
+        if (!DAG::isDAG()) {
+            return;
+        }
+        O.resize(plan.slotNum);
+        return forwardState(x, O, [&plan](int i){return plan.slotOf(i);});
+    }
+
+    template<typename TInput, typename F>
+    void forwardState(const TInput &x, State &O, F slotOf) const
+    {
+        for (int current : DAG::topologySequence) {
+            const auto &layer = DAG::getObject(current);
+            Mat<T> s;
+            if (isInput(layer.layerType)) {
+                s = layer.forward(0, inputOf(x, current));
+            } else if (layer.isPacked()) {
+                Mat<T> X;
+                packInput(current, [&O, &slotOf](int i) -> const Mat<T>& {return O[slotOf(i)];}, X);
+                s = layer.Wc * X;
             } else {
-                for (int to : DAG::nexts[current]) {
-                    auto &nextLayer = DAG::getObject(to);
-                    layer.E += nextLayer.W[current].Tr() * nextLayer.E;
+                const std::vector<int> &previous = DAG::previous[current];
+                for (std::size_t k = 0; k < previous.size(); k++) {
+                    if (s.isNull()) {
+                        s = layer.forward(k, O[slotOf(previous[k])]);
+                    } else {
+                        s += layer.forward(k, O[slotOf(previous[k])]);
+                    }
+                }
+            }
+            for (int i = 0; i < s.rows; i++) {
+                for (int j = 0; j < s.cols; j++) {
+                    s.data[i][j] += layer.B.data[i][0];
                 }
             }
+            Mat<T> &o = O[slotOf(current)];
+            if (!o.isShapeEqual(s)) {
+                o.create(s.rows, s.cols);
+            }
+            if (!isInput(layer.layerType) && isSoftmax(layer.lossType)) {
+                softmax(s, o);
+            } else {
+                o = ActivateF<T>::_(s);
+            }
         }
+        return;
+    }
 
+    /*
+        memory plan of one pass, steps follow topologySequence:
+        forward of the i-th vertex is step i, training adds its backward at
+        2N - 1 - i and its gradient at 2N + i. activations are added first,
+        so the tensor id of the activation of vertex i is i.
+        sizes are in elements, inputs and parameters are not planned.
+    */
+    ML::MemoryPlan plan(int batchSize = 1, bool training = true) const
+    {
+        ML::MemoryPlan memoryPlan;
+        if (!DAG::isDAG()) {
+            return memoryPlan;
+        }
+        int N = DAG::vertexs.size();
+        std::vector<int> pos(N);
+        for (int i = 0; i < N; i++) {
+            pos[DAG::topologySequence[i]] = i;
+        }
+        auto forwardStep = [&pos](int i){return pos[i];};
+        auto backwardStep = [&pos, N](int i){return 2 * N - 1 - pos[i];};
+        auto gradientStep = [&pos, N](int i){return 2 * N + pos[i];};
+        for (int i = 0; i < N; i++) {
+            const auto &layer = DAG::getObject(i);
+            int end = i == outputIndex() ? N - 1 : forwardStep(i);
+            for (int to : DAG::nexts[i]) {
+                end = std::max(end, training ? gradientStep(to) : forwardStep(to));
+            }
+            if (training) {
+                end = std::max(end, gradientStep(i));
+            }
+            memoryPlan.add(DAG::vertexs[i].name + ".O", ML::ACTIVATION_TENSOR,
+                           size_t(layer.layerDim) * batchSize, forwardStep(i), end);
+        }
+        for (int i = 0; i < N; i++) {
+            const auto &layer = DAG::getObject(i);
+            const std::string &name = DAG::vertexs[i].name;
+            size_t size = size_t(layer.layerDim) * batchSize;
+            /* weighted sum before the activation */
+            memoryPlan.add(name + ".s", ML::TEMPORARY_TENSOR, size, forwardStep(i), forwardStep(i));
+            if (layer.isPacked()) {
+                size_t packed = size_t(layer.Wc.cols) * batchSize;
+                memoryPlan.add(name + ".X", ML::TEMPORARY_TENSOR, packed,
+                               forwardStep(i), training ? gradientStep(i) : forwardStep(i));
+            }
+            if (!training) {
+                continue;
+            }
+            int end = gradientStep(i);
+            for (int from : DAG::previous[i]) {
+                end = std::max(end, backwardStep(from));
+            }
+            memoryPlan.add(name + ".E", ML::ERROR_TENSOR, size, backwardStep(i), end);
+            /* W^T of the outgoing edges, one at a time */
+            size_t transposed = 0;
+            for (int to : DAG::nexts[i]) {
+                transposed = std::max(transposed, size_t(DAG::getObject(to).layerDim) * layer.layerDim);
+            }
+            memoryPlan.add(name + ".WT", ML::TEMPORARY_TENSOR, transposed, backwardStep(i), backwardStep(i));
+            memoryPlan.add(name + ".dy", ML::TEMPORARY_TENSOR, size, gradientStep(i), gradientStep(i));
+            /* dy * x^T of each incoming weight */
+            size_t outer = 0;
+            for (auto &w : layer.W) {
+                outer = std::max(outer, size_t(w.rows) * w.cols);
+            }
+            memoryPlan.add(name + ".dyxT", ML::TEMPORARY_TENSOR, outer, gradientStep(i), gradientStep(i));
+        }
+        memoryPlan.solve();
+        return memoryPlan;
+    }
+
+    inline int outputIndex() const {return DAG::topologySequence.back();}
+
+    template<typename TInput>
+    void gradient(const TInput &x, Mat<T> &y)
+    {
+        if (!DAG::isDAG()) {
+            return;
+        }
+        /* error backpropagate */
+        for (int i = DAG::topologySequence.size() - 1; i >= 0; i--) {
+            backwardVertex(DAG::topologySequence[i], y);
+        }
         /* calculate  gradient */
         for (int current : DAG::topologySequence) {
-            auto &layer = DAG::getObject(current);
-            if (layer.lossType == CROSS_ENTROPY) {
-                Mat<T> dy = layer.O - y;
-                layer.dW[0] += dy * layer.O.Tr();
-                layer.dB += dy;
-            } else if (layer.lossType == MSE) {
-                Mat<T> dy = layer.E % ActivateF<T>::d(layer.O);
-                if (layer.layerType == INPUT) {
-                    layer.dW[0] += dy * x[DAG::vertexs[current].name].Tr();
+            gradientVertex(current, x);
+        }
+        return;
+    }
+
+    /* errors flow level by level in reverse, gradients of all layers are independent */
+    template<typename TInput>
+    void gradient(const TInput &x, Mat<T> &y, ThreadPool &pool)
+    {
+        if (!DAG::isDAG()) {
+            return;
+        }
+        for (int i = DAG::levels.size() - 1; i >= 0; i--) {
+            auto &level = DAG::levels[i];
+            pool.parallelFor(level.size(), [&](int k){backwardVertex(level[k], y);});
+        }
+        auto &sequence = DAG::topologySequence;
+        pool.parallelFor(sequence.size(), [&](int k){gradientVertex(sequence[k], x);});
+        return;
+    }
+
+    /* weights read by the error of a layer, for the profiler */
+    double backwardWeights(int current)
+    {
+        double weights = 0;
+        for (int to : DAG::nexts[current]) {
+            weights += double(DAG::getObject(current).layerDim) * DAG::getObject(to).layerDim;
+        }
+        return weights;
+    }
+
+    void backwardVertex(int current, const Mat<T> &y)
+    {
+        auto &layer = DAG::getObject(current);
+        ML_PROFILE_SCOPE("backward", DAG::vertexs[current].name.c_str(),
+                         2 * backwardWeights(current) * layer.E.cols, sizeof(T) * backwardWeights(current));
+        if (layer.layerType == OUTPUT && layer.lossType == SAMPLED_SOFTMAX) {
+            sampledError(current, y);
+        } else if (layer.layerType == OUTPUT) {
+            /* error of the output: O - y, for cross entropy it is the gradient
+               of the loss to the logits, so no log of O is needed */
+            layer.E = layer.O - y;
+            if (scaler.isEnabled()) {
+                layer.E *= T(scaler.scale);
+            }
+        } else {
+            const std::vector<int> &nexts = DAG::nexts[current];
+            for (std::size_t j = 0; j < nexts.size(); j++) {
+                auto &nextLayer = DAG::getObject(nexts[j]);
+                if (nextLayer.layerType == OUTPUT && nextLayer.lossType == SAMPLED_SOFTMAX) {
+                    sampledBackward(nextLayer, DAG::outSlot[current][j], layer.E);
                 } else {
-                    for (int from : DAG::previous.at(current)) {
-                        auto &preLayer = DAG::getObject(from);
-                        layer.dW[from] += dy * preLayer.O.Tr();
+                    gemm(T(1), nextLayer.W[DAG::outSlot[current][j]], TRANSPOSE,
+                         nextLayer.E, NORMAL, T(1), layer.E);
+                }
+            }
+        }
+        return;
+    }
+
+    /*
+        sampled softmax: logits of the target classes of y and sampler.sampleNum
+        negatives shared by the batch, corrected by logQ, then the fused softmax
+        cross entropy. only the rows of W of these classes are read.
+    */
+    void sampledError(int current, const Mat<T> &y)
+    {
+        auto &layer = DAG::getObject(current);
+        const std::vector<int> &previous = DAG::previous[current];
+        std::vector<int> &candidates = layer.candidates;
+        candidates.clear();
+        std::vector<int> target(y.cols, 0);
+        for (int i = 1; i < y.rows; i++) {
+            for (int j = 0; j < y.cols; j++) {
+                if (y.data[i][j] > y.data[target[j]][j]) {
+                    target[j] = i;
+                }
+            }
+        }
+        std::vector<int> targetRow(y.cols);
+        for (int j = 0; j < y.cols; j++) {
+            auto it = std::find(candidates.begin(), candidates.end(), target[j]);
+            targetRow[j] = it - candidates.begin();
+            if (it == candidates.end()) {
+                candidates.push_back(target[j]);
+            }
+        }
+        sampler.sample(layer.layerDim, candidates);
+        int candidateNum = candidates.size();
+        Mat<T> logits(candidateNum, y.cols);
+        for (int r = 0; r < candidateNum; r++) {
+            int c = candidates[r];
+            std::vector<T> &z = logits.data[r];
+            for (std::size_t k = 0; k < previous.size(); k++) {
+                const std::vector<T> &w = layer.W[k].data[c];
+                const Mat<T> &o = DAG::getObject(previous[k]).O;
+                for (int i = 0; i < o.rows; i++) {
+                    for (int j = 0; j < o.cols; j++) {
+                        z[j] += w[i] * o.data[i][j];
                     }
+                }
+            }
+            T bias = layer.B.data[c][0] - T(sampler.logQ(c, layer.layerDim));
+            for (int j = 0; j < y.cols; j++) {
+                z[j] += bias;
+            }
+        }
+        Mat<T> label(candidateNum, y.cols);
+        for (int j = 0; j < y.cols; j++) {
+            label.data[targetRow[j]][j] = 1;
+        }
+        Mat<T> prob;
+        softmaxCrossEntropy(logits, label, prob, layer.Ec);
+        if (scaler.isEnabled()) {
+            layer.Ec *= T(scaler.scale);
+        }
+        return;
+    }
+
+    /* E += W[k]^T * Ec over the candidate rows of a sampled softmax layer */
+    void sampledBackward(const TLayer &nextLayer, int k, Mat<T> &E) const
+    {
+        const Mat<T> &Ec = nextLayer.Ec;
+        if (E.cols != Ec.cols) {
+            std::cout<<"sampled softmax error size is not matched"<<std::endl;
+            return;
+        }
+        for (std::size_t r = 0; r < nextLayer.candidates.size(); r++) {
+            const std::vector<T> &w = nextLayer.W[k].data[nextLayer.candidates[r]];
+            const std::vector<T> &e = Ec.data[r];
+            for (int i = 0; i < E.rows; i++) {
+                for (int j = 0; j < E.cols; j++) {
+                    E.data[i][j] += w[i] * e[j];
+                }
+            }
+        }
+        return;
+    }
 
+    /* dW[k] and dB of the candidate rows only */
+    void sampledGradient(int current)
+    {
+        auto &layer = DAG::getObject(current);
+        const std::vector<int> &previous = DAG::previous[current];
+        const Mat<T> &Ec = layer.Ec;
+        for (std::size_t r = 0; r < layer.candidates.size(); r++) {
+            int c = layer.candidates[r];
+            const std::vector<T> &e = Ec.data[r];
+            for (std::size_t k = 0; k < previous.size(); k++) {
+                const Mat<T> &o = DAG::getObject(previous[k]).O;
+                std::vector<T> &dw = layer.dW[k].data[c];
+                for (int i = 0; i < o.rows; i++) {
+                    T s = 0;
+                    for (int j = 0; j < o.cols; j++) {
+                        s += e[j] * o.data[i][j];
+                    }
+                    dw[i] += s;
                 }
-                layer.dB += dy;
-                layer.E.zero();
+            }
+            T s = 0;
+            for (int j = 0; j < Ec.cols; j++) {
+                s += e[j];
+            }
+            layer.dB.data[c][0] += s;
+            layer.markRow(c);
+        }
+        return;
+    }
+
+    template<typename TInput>
+    void gradientVertex(int current, const TInput &x)
+    {
+        auto &layer = DAG::getObject(current);
+        ML_PROFILE_SCOPE("gradient", DAG::vertexs[current].name.c_str(),
+                         2 * layer.weightSize() * layer.O.cols, 2 * sizeof(T) * layer.weightSize());
+        if (layer.layerType == OUTPUT && layer.lossType == SAMPLED_SOFTMAX) {
+            return sampledGradient(current);
+        }
+        /* softmax and cross entropy are fused, E of such an output is already the gradient of s */
+        Mat<T> dy = layer.layerType == OUTPUT && layer.lossType == CROSS_ENTROPY ?
+                    layer.E : layer.E % ActivateF<T>::d(layer.O);
+        if (layer.layerType == INPUT) {
+            accumulateOuter(layer.dW[0], dy, inputOf(x, current));
+        } else if (layer.layerType == EMBEDDING) {
+            layer.accumulateEmbedding(dy, inputOf(x, current));
+        } else if (layer.isPacked()) {
+            layer.accumulatePacked(dy);
+        } else {
+            const std::vector<int> &previous = DAG::previous[current];
+            for (std::size_t k = 0; k < previous.size(); k++) {
+                auto &preLayer = DAG::getObject(previous[k]);
+                gemm(T(1), dy, NORMAL, preLayer.O, TRANSPOSE, T(1), layer.dW[k]);
             }
         }
+        layer.dB += dy;
+        layer.E.zero();
         return;
     }
+
     void optimize(double learningRate)
     {
         if (!DAG::isDAG()) {
             return;
         }
+        if (scaler.isEnabled() && !unscale()) {
+            return;
+        }
         for (int current : DAG::topologySequence) {
-            DAG::getObject(current).optimize(DAG::previous.at(current), learningRate);
+            optimizeVertex(current, learningRate);
         }
         return;
     }
+
+    void optimize(double learningRate, ThreadPool &pool)
+    {
+        if (!DAG::isDAG()) {
+            return;
+        }
+        if (scaler.isEnabled() && !unscale()) {
+            return;
+        }
+        auto &sequence = DAG::topologySequence;
+        pool.parallelFor(sequence.size(), [&](int k){optimizeVertex(sequence[k], learningRate);});
+        return;
+    }
+
+    void optimizeVertex(int current, double learningRate)
+    {
+        auto &layer = DAG::getObject(current);
+        /* read W, dW and the optimizer state, write W */
+        ML_PROFILE_SCOPE("optimize", DAG::vertexs[current].name.c_str(),
+                         4 * layer.weightSize(), 4 * sizeof(T) * layer.weightSize());
+        layer.optimize(learningRate);
+        return;
+    }
+    /* undo loss scaling, skip the step when gradients overflowed */
+    bool unscale()
+    {
+        bool overflow = false;
+        for (auto &v : DAG::vertexs) {
+            auto &layer = v.object;
+            for (auto &w : layer.dW) {
+                overflow = overflow || !isFinite(w);
+            }
+            overflow = overflow || !isFinite(layer.dB);
+        }
+        T s = T(1.0 / scaler.scale);
+        for (auto &v : DAG::vertexs) {
+            auto &layer = v.object;
+            for (auto &w : layer.dW) {
+                if (overflow) {
+                    w.zero();
+                } else {
+                    w *= s;
+                }
+            }
+            if (overflow) {
+                layer.dB.zero();
+            } else {
+                layer.dB *= s;
+            }
+        }
+        scaler.update(overflow);
+        return !overflow;
+    }
+
+    /* magnitude pruning of every layer, pruned layers run sparse kernels */
+    void prune(double sparsity)
+    {
+        for (auto &v : DAG::vertexs) {
+            v.object.unpack();
+            v.object.prune(sparsity);
+        }
+        return;
+    }
+
     void show()
     {
         DAG::vertexs[DAG::topologySequence.size() - 1].object.O.show();
@@ -0,0 +1,182 @@
+#ifndef PLANNER_HPP
+#define PLANNER_HPP
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+namespace ML {
+
+enum TensorKind {
+    ACTIVATION_TENSOR = 0,
+    ERROR_TENSOR,
+    TEMPORARY_TENSOR
+};
+
+/*
+    static memory plan: every tensor lives in steps [begin, end] and gets an
+    offset in one shared slab, tensors whose lifetimes do not overlap may share
+    memory. slots give a buffer reuse for containers that own their storage.
+*/
+class MemoryPlan
+{
+public:
+    struct Tensor
+    {
+        std::string name;
+        TensorKind kind;
+        size_t size;
+        int begin;
+        int end;
+        size_t offset;
+        int slot;
+        inline bool isAlive(int step) const {return begin <= step && step <= end;}
+        inline bool overlap(const Tensor &x) const {return begin <= x.end && x.begin <= end;}
+    };
+public:
+    std::vector<Tensor> tensors;
+    size_t peakSize;
+    int slotNum;
+public:
+    MemoryPlan():peakSize(0), slotNum(0){}
+    int add(const std::string &name, TensorKind kind, size_t size, int begin, int end)
+    {
+        Tensor t;
+        t.name = name;
+        t.kind = kind;
+        t.size = size;
+        t.begin = begin;
+        t.end = end < begin ? begin : end;
+        t.offset = 0;
+        t.slot = -1;
+        tensors.push_back(t);
+        return tensors.size() - 1;
+    }
+    inline size_t offsetOf(int id) const {return tensors[id].offset;}
+    inline int slotOf(int id) const {return tensors[id].slot;}
+
+    /* memory without reuse */
+    size_t totalSize() const
+    {
+        size_t n = 0;
+        for (auto &t : tensors) {
+            n += t.size;
+        }
+        return n;
+    }
+
+    /* sum of the live tensors at the busiest step, no plan can do better */
+    size_t lowerBound() const
+    {
+        size_t m = 0;
+        for (auto &t : tensors) {
+            size_t n = 0;
+            for (auto &x : tensors) {
+                if (x.isAlive(t.begin)) {
+                    n += x.size;
+                }
+            }
+            m = n > m ? n : m;
+        }
+        return m;
+    }
+
+    void solve()
+    {
+        assignOffset();
+        assignSlot();
+        return;
+    }
+
+    void show() const
+    {
+        static const char* kinds[] = {"activation", "error", "temporary"};
+        for (auto &t : tensors) {
+            std::cout<<t.name<<" "<<kinds[t.kind]<<" size: "<<t.size
+                     <<" steps: ["<<t.begin<<", "<<t.end<<"]"
+                     <<" offset: "<<t.offset<<" slot: "<<t.slot<<std::endl;
+        }
+        std::cout<<"tensors: "<<tensors.size()<<" slots: "<<slotNum<<std::endl;
+        std::cout<<"without reuse: "<<totalSize()
+                 <<" planned peak: "<<peakSize
+                 <<" lower bound: "<<lowerBound()<<std::endl;
+        return;
+    }
+protected:
+    /* greedy by size: place large tensors first at the lowest free offset */
+    void assignOffset()
+    {
+        std::vector<int> order(tensors.size());
+        for (std::size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+            return tensors[a].size > tensors[b].size;
+        });
+        std::vector<int> placed;
+        peakSize = 0;
+        for (int id : order) {
+            Tensor &t = tensors[id];
+            /* placed tensors that overlap in time, by offset */
+            std::vector<int> conflicts;
+            for (int p : placed) {
+                if (tensors[p].overlap(t)) {
+                    conflicts.push_back(p);
+                }
+            }
+            std::sort(conflicts.begin(), conflicts.end(), [this](int a, int b) {
+                return tensors[a].offset < tensors[b].offset;
+            });
+            size_t offset = 0;
+            for (int c : conflicts) {
+                if (offset + t.size <= tensors[c].offset) {
+                    break;
+                }
+                size_t end = tensors[c].offset + tensors[c].size;
+                offset = end > offset ? end : offset;
+            }
+            t.offset = offset;
+            placed.push_back(id);
+            peakSize = offset + t.size > peakSize ? offset + t.size : peakSize;
+        }
+        return;
+    }
+
+    /* interval coloring, a free slot of the same size is preferred */
+    void assignSlot()
+    {
+        std::vector<int> order(tensors.size());
+        for (std::size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+            return tensors[a].begin < tensors[b].begin;
+        });
+        /* last tensor of each slot */
+        std::vector<int> owner;
+        for (int id : order) {
+            Tensor &t = tensors[id];
+            int slot = -1;
+            for (std::size_t s = 0; s < owner.size(); s++) {
+                const Tensor &last = tensors[owner[s]];
+                if (last.end >= t.begin) {
+                    continue;
+                }
+                if (slot < 0 || (last.size == t.size && tensors[owner[slot]].size != t.size)) {
+                    slot = s;
+                }
+            }
+            if (slot < 0) {
+                slot = owner.size();
+                owner.push_back(id);
+            }
+            owner[slot] = id;
+            t.slot = slot;
+        }
+        slotNum = owner.size();
+        return;
+    }
+};
+
+}
+#endif // PLANNER_HPP
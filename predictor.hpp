@@ -0,0 +1,237 @@
+#ifndef PREDICTOR_HPP
+#define PREDICTOR_HPP
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include "mlp.hpp"
+
+/* thread-safe inference on a shared model, weights are read only */
+template <typename TNet>
+class Predictor
+{
+public:
+    using T = typename TNet::DataType;
+    using Input = typename TNet::Input;
+    using State = typename TNet::State;
+protected:
+    TNet net;
+public:
+    Predictor(){}
+    explicit Predictor(const TNet &net_):net(net_){}
+    Mat<T> operator()(const Input &x) const
+    {
+        State state;
+        return predict(x, state);
+    }
+    Mat<T> predict(const Input &x, State &state) const
+    {
+        if (!net.isDAG()) {
+            std::cout<<"invalid graph"<<std::endl;
+            return Mat<T>();
+        }
+        net.feedForward(x, state);
+        return state[net.outputIndex()];
+    }
+    /* empty when x is one sample the model accepts, otherwise the reason */
+    std::string check(const Input &x) const
+    {
+        for (auto &v : net.vertexs) {
+            const auto &layer = v.object;
+            if (!isInput(layer.layerType)) {
+                continue;
+            }
+            auto it = x.find(v.name);
+            if (it == x.end()) {
+                return "missing input " + v.name;
+            }
+            const Mat<T> &xi = it->second;
+            if (xi.cols != 1) {
+                return "input " + v.name + " is not one column";
+            }
+            /* an embedding takes any number of ids */
+            bool matched = layer.layerType == EMBEDDING ? xi.rows > 0 : xi.rows == layer.inputDim;
+            if (!matched) {
+                return "input " + v.name + " size is not matched";
+            }
+        }
+        return std::string();
+    }
+    /* sample k is column k, ids of an embedding are padded with -1 to the longest sample */
+    Input gather(const std::vector<const Input*> &xs) const
+    {
+        Input x;
+        int n = xs.size();
+        for (auto &v : net.vertexs) {
+            const auto &layer = v.object;
+            if (!isInput(layer.layerType)) {
+                continue;
+            }
+            int rows = 0;
+            for (int k = 0; k < n; k++) {
+                rows = std::max(rows, xs[k]->at(v.name).rows);
+            }
+            Mat<T> xi(rows, n);
+            if (layer.layerType == EMBEDDING) {
+                xi.view().assign(T(-1));
+            }
+            for (int k = 0; k < n; k++) {
+                xi.set(0, k, xs[k]->at(v.name));
+            }
+            x[v.name] = xi;
+        }
+        return x;
+    }
+};
+
+/* coalesce requests arriving within a time window into one batched forward */
+template <typename TNet>
+class Batcher
+{
+public:
+    using T = typename TNet::DataType;
+    using Input = typename TNet::Input;
+    using State = typename TNet::State;
+    struct Request
+    {
+        Input x;
+        std::promise<Mat<T> > result;
+    };
+protected:
+    Predictor<TNet> predictor;
+    int maxBatchSize;
+    std::chrono::microseconds window;
+    bool running;
+    std::mutex mutex;
+    std::condition_variable condit;
+    std::deque<Request> requests;
+    std::thread worker;
+    /* statistic */
+    int batchCount;
+    int sampleCount;
+public:
+    Batcher(const TNet &net, int maxBatchSize_, std::chrono::microseconds window_):
+        predictor(net), maxBatchSize(maxBatchSize_), window(window_),
+        running(true), batchCount(0), sampleCount(0)
+    {
+        worker = std::thread(&Batcher::run, this);
+    }
+    ~Batcher()
+    {
+        stop();
+    }
+    Batcher(const Batcher &) = delete;
+    Batcher& operator = (const Batcher &) = delete;
+
+    std::future<Mat<T> > submit(const Input &x)
+    {
+        Request request;
+        request.x = x;
+        std::future<Mat<T> > result = request.result.get_future();
+        {
+            std::lock_guard<std::mutex> locker(mutex);
+            if (!running) {
+                std::cout<<"batcher is stopped"<<std::endl;
+                return result;
+            }
+            requests.push_back(std::move(request));
+        }
+        condit.notify_one();
+        return result;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> locker(mutex);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        condit.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+        return;
+    }
+
+    double averageBatchSize()
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        return batchCount == 0 ? 0 : double(sampleCount) / batchCount;
+    }
+protected:
+    void run()
+    {
+        while (true) {
+            std::vector<Request> batch;
+            {
+                std::unique_lock<std::mutex> locker(mutex);
+                condit.wait(locker, [this]{return !running || !requests.empty();});
+                if (requests.empty()) {
+                    return;
+                }
+                /* wait for the window to fill up the batch */
+                auto deadline = std::chrono::steady_clock::now() + window;
+                condit.wait_until(locker, deadline, [this]{
+                    return !running || int(requests.size()) >= maxBatchSize;
+                });
+                int n = std::min<int>(maxBatchSize, requests.size());
+                for (int i = 0; i < n; i++) {
+                    batch.push_back(std::move(requests.front()));
+                    requests.pop_front();
+                }
+                batchCount++;
+                sampleCount += n;
+            }
+            try {
+                process(batch);
+            } catch (...) {
+                std::exception_ptr error = std::current_exception();
+                for (auto &request : batch) {
+                    /* requests scattered before the throw already have their value */
+                    try {
+                        request.result.set_exception(error);
+                    } catch (const std::future_error &) {
+                    }
+                }
+            }
+        }
+    }
+
+    void process(std::vector<Request> &batch)
+    {
+        /* a malformed request fails alone, the rest of the batch still runs */
+        std::vector<Request*> valid;
+        std::vector<const Input*> xs;
+        for (auto &request : batch) {
+            std::string error = predictor.check(request.x);
+            if (!error.empty()) {
+                request.result.set_exception(std::make_exception_ptr(std::invalid_argument(error)));
+                continue;
+            }
+            valid.push_back(&request);
+            xs.push_back(&request.x);
+        }
+        if (valid.empty()) {
+            return;
+        }
+        Input x = predictor.gather(xs);
+        State state;
+        Mat<T> y = predictor.predict(x, state);
+        /* scatter */
+        for (std::size_t k = 0; k < valid.size(); k++) {
+            valid[k]->result.set_value(Mat<T>(y.column(k)));
+        }
+        return;
+    }
+};
+#endif // PREDICTOR_HPP
@@ -0,0 +1,207 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <cstdio>
+
+namespace ML {
+
+/*
+    scoped timers for the hot paths, compiled with -DML_PROFILE they record
+    events. call sites use ML_PROFILE_SCOPE(category, name, flops, bytes), without
+    ML_PROFILE it expands to nothing, so the name and cost expressions are not evaluated.
+    results: Profiler::instance().show() or exportTrace("trace.json"),
+    the trace opens in chrome://tracing or ui.perfetto.dev
+*/
+class Profiler
+{
+public:
+    struct Event
+    {
+        std::string category;
+        std::string name;
+        int tid;
+        double begin;
+        double duration;
+        double flops;
+        double bytes;
+    };
+    struct Summary
+    {
+        int count;
+        double time;
+        double flops;
+        double bytes;
+        Summary():count(0), time(0), flops(0), bytes(0){}
+    };
+    using Clock = std::chrono::steady_clock;
+protected:
+    std::mutex mutex;
+    Clock::time_point start;
+    std::vector<Event> events;
+    std::map<std::thread::id, int> threads;
+protected:
+    Profiler():start(Clock::now()){}
+public:
+    Profiler(const Profiler &) = delete;
+    Profiler& operator = (const Profiler &) = delete;
+    static Profiler& instance()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+    static constexpr bool isEnabled()
+    {
+#ifdef ML_PROFILE
+        return true;
+#else
+        return false;
+#endif
+    }
+    /* microseconds since the profiler started */
+    inline double now() const
+    {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+    void record(const char* category, const char* name,
+                double begin, double duration, double flops, double bytes)
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        auto it = threads.find(std::this_thread::get_id());
+        if (it == threads.end()) {
+            it = threads.insert(std::make_pair(std::this_thread::get_id(), int(threads.size()))).first;
+        }
+        Event e;
+        e.category = category;
+        e.name = name;
+        e.tid = it->second;
+        e.begin = begin;
+        e.duration = duration;
+        e.flops = flops;
+        e.bytes = bytes;
+        events.push_back(e);
+        return;
+    }
+    void clear()
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        events.clear();
+        return;
+    }
+    /* totals by category and name */
+    std::map<std::string, Summary> summary()
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        std::map<std::string, Summary> s;
+        for (auto &e : events) {
+            Summary &x = s[e.category + "/" + e.name];
+            x.count++;
+            x.time += e.duration;
+            x.flops += e.flops;
+            x.bytes += e.bytes;
+        }
+        return s;
+    }
+    void show()
+    {
+        std::map<std::string, Summary> s = summary();
+        double total = 0;
+        for (auto &x : s) {
+            total += x.second.time;
+        }
+        std::printf("%-32s %8s %12s %10s %7s %10s %10s\n",
+                    "scope", "count", "total(ms)", "mean(us)", "%", "GFLOP/s", "GB/s");
+        for (auto &x : s) {
+            const Summary &v = x.second;
+            double seconds = v.time * 1e-6;
+            std::printf("%-32s %8d %12.3f %10.3f %7.2f %10.3f %10.3f\n",
+                        x.first.c_str(), v.count, v.time * 1e-3, v.time / v.count,
+                        total > 0 ? 100 * v.time / total : 0,
+                        seconds > 0 ? v.flops / seconds * 1e-9 : 0,
+                        seconds > 0 ? v.bytes / seconds * 1e-9 : 0);
+        }
+        return;
+    }
+    /* json string content, names come from user layer names */
+    static std::string escape(const std::string &text)
+    {
+        std::string y;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                y.push_back('\\');
+                y.push_back(c);
+            } else if ((unsigned char)c < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+                y += code;
+            } else {
+                y.push_back(c);
+            }
+        }
+        return y;
+    }
+    /* chrome trace event format, complete events */
+    void exportTrace(const std::string &fileName)
+    {
+        std::ofstream file(fileName);
+        if (!file.is_open()) {
+            std::cout<<"failed to open "<<fileName<<std::endl;
+            return;
+        }
+        std::lock_guard<std::mutex> locker(mutex);
+        file<<"{\"traceEvents\":[\n";
+        for (std::size_t i = 0; i < events.size(); i++) {
+            const Event &e = events[i];
+            file<<"{\"name\":\""<<escape(e.name)<<"\",\"cat\":\""<<escape(e.category)<<"\",\"ph\":\"X\""
+                <<",\"ts\":"<<e.begin<<",\"dur\":"<<e.duration
+                <<",\"pid\":0,\"tid\":"<<e.tid
+                <<",\"args\":{\"flops\":"<<e.flops<<",\"bytes\":"<<e.bytes<<"}}"
+                <<(i + 1 < events.size() ? ",\n" : "\n");
+        }
+        file<<"],\"displayTimeUnit\":\"ms\"}\n";
+        return;
+    }
+};
+
+#ifdef ML_PROFILE
+class ScopedTimer
+{
+protected:
+    const char* category;
+    const char* name;
+    double flops;
+    double bytes;
+    double begin;
+public:
+    ScopedTimer(const char* category_, const char* name_, double flops_ = 0, double bytes_ = 0):
+        category(category_), name(name_), flops(flops_), bytes(bytes_),
+        begin(Profiler::instance().now()){}
+    ~ScopedTimer()
+    {
+        Profiler &profiler = Profiler::instance();
+        profiler.record(category, name, begin, profiler.now() - begin, flops, bytes);
+    }
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer& operator = (const ScopedTimer &) = delete;
+};
+/* ML_PROFILE_SCOPE(category, name[, flops[, bytes]]), one per scope */
+#define ML_PROFILE_SCOPE(...) ML::ScopedTimer profileScope(__VA_ARGS__)
+#else
+class ScopedTimer
+{
+public:
+    inline ScopedTimer(const char*, const char*, double = 0, double = 0){}
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer& operator = (const ScopedTimer &) = delete;
+};
+#define ML_PROFILE_SCOPE(...)
+#endif
+
+}
+#endif // PROFILER_HPP
@@ -0,0 +1,355 @@
+#ifndef QUANTIZE_HPP
+#define QUANTIZE_HPP
+#include <iostream>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <cmath>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "mlp.hpp"
+
+namespace ML {
+
+/*
+    symmetric int8 quantization: real = scale * q, q in [-127, 127]
+    rows are stored contiguously and padded to a multiple of 32 with zeros
+*/
+class QMat
+{
+public:
+    static constexpr int align = 32;
+    int rows;
+    int cols;
+    int stride;
+    float scale;
+    std::vector<int8_t> data;
+public:
+    QMat():rows(0), cols(0), stride(0), scale(1){}
+    QMat(int rows_, int cols_, float scale_):
+        rows(rows_), cols(cols_), stride((cols_ + align - 1) / align * align),
+        scale(scale_), data(rows_ * stride, 0){}
+    inline int8_t* operator[](int i) {return data.data() + i * stride;}
+    inline const int8_t* operator[](int i) const {return data.data() + i * stride;}
+    inline size_t bytes() const {return data.size() * sizeof(int8_t);}
+
+    static inline int8_t quantize(double x, float scale)
+    {
+        double q = std::round(x / scale);
+        q = q > 127 ? 127 : q;
+        q = q < -127 ? -127 : q;
+        return int8_t(q);
+    }
+
+    template<typename T>
+    static float scaleOf(T maxAbs)
+    {
+        return maxAbs > 0 ? float(maxAbs) / 127 : 1;
+    }
+
+    /* quantize a matrix row by row */
+    template<typename T>
+    static QMat from(const Mat<T> &x, float scale)
+    {
+        QMat y(x.rows, x.cols, scale);
+        for (int i = 0; i < x.rows; i++) {
+            for (int j = 0; j < x.cols; j++) {
+                y[i][j] = quantize(x.data[i][j], scale);
+            }
+        }
+        return y;
+    }
+
+    /* quantize a matrix column by column, sample j becomes row j */
+    template<typename T>
+    static QMat fromColumns(const Mat<T> &x, float scale)
+    {
+        QMat y(x.cols, x.rows, scale);
+        for (int i = 0; i < x.rows; i++) {
+            for (int j = 0; j < x.cols; j++) {
+                y[j][i] = quantize(x.data[i][j], scale);
+            }
+        }
+        return y;
+    }
+};
+
+/* dot product of two padded int8 rows with int32 accumulation */
+inline int32_t dot8(const int8_t *a, const int8_t *b, int n)
+{
+#ifdef __AVX2__
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    for (int k = 0; k < n; k += QMat::align) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + k));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k));
+        /*
+            vpmaddubsw multiplies unsigned by signed bytes, so move the sign of a onto b.
+            |a|*|b| <= 127*127, a pair sum never saturates int16
+        */
+        __m256i ua = _mm256_sign_epi8(va, va);
+        __m256i sb = _mm256_sign_epi8(vb, va);
+        __m256i p16 = _mm256_maddubs_epi16(ua, sb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p16, ones));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_hadd_epi32(s, s);
+    s = _mm_hadd_epi32(s, s);
+    return _mm_cvtsi128_si32(s);
+#else
+    int32_t s = 0;
+    for (int k = 0; k < n; k++) {
+        s += int32_t(a[k]) * int32_t(b[k]);
+    }
+    return s;
+#endif
+}
+
+/*
+    y += W * x^T, W: (m, p) weights, xt: (n, p) samples stored as rows,
+    y: (m, n) dequantized with W.scale * xt.scale
+*/
+template<typename T>
+void qgemm(const QMat &W, const QMat &xt, Mat<T> &y)
+{
+    if (W.cols != xt.cols) {
+        std::cout<<"qgemm size is not matched"<<std::endl;
+        return;
+    }
+    T alpha = T(W.scale) * T(xt.scale);
+    for (int i = 0; i < W.rows; i++) {
+        const int8_t *w = W[i];
+        for (int j = 0; j < xt.rows; j++) {
+            y.data[i][j] += alpha * T(dot8(w, xt[j], W.stride));
+        }
+    }
+    return;
+}
+
+template<typename T>
+T maxAbs(const Mat<T> &x)
+{
+    T m = 0;
+    for (int i = 0; i < x.rows; i++) {
+        for (int j = 0; j < x.cols; j++) {
+            T a = x.data[i][j] < 0 ? -x.data[i][j] : x.data[i][j];
+            m = a > m ? a : m;
+        }
+    }
+    return m;
+}
+
+}
+
+/*
+    post-training quantization of a trained MLP:
+    weights are int8 per edge, activations are quantized with per-layer scales
+    calibrated from sample inputs, accumulation is int32.
+*/
+template <typename TNet>
+class QuantizedMLP
+{
+public:
+    using T = typename TNet::DataType;
+    using Input = typename TNet::Input;
+    using InputVec = typename TNet::InputVec;
+    using State = typename TNet::State;
+    struct QLayer
+    {
+        LayerType layerType;
+        LossType lossType;
+        std::vector<QMat> W;
+        Mat<T> B;
+    };
+    struct Report
+    {
+        int sampleNum;
+        double maxError;
+        double meanError;
+        double argmaxAgreement;
+        size_t fp32Bytes;
+        size_t int8Bytes;
+        void show() const
+        {
+            std::cout<<"samples: "<<sampleNum<<std::endl;
+            std::cout<<"max abs error: "<<maxError<<std::endl;
+            std::cout<<"mean abs error: "<<meanError<<std::endl;
+            std::cout<<"argmax agreement: "<<argmaxAgreement<<std::endl;
+            std::cout<<"weights fp32: "<<fp32Bytes<<" bytes, int8: "<<int8Bytes<<" bytes"<<std::endl;
+            return;
+        }
+    };
+public:
+    std::vector<QLayer> layers;
+    std::vector<std::string> names;
+    std::vector<int> topologySequence;
+    std::vector<std::vector<int> > previous;
+    /* activation scale of each vertex output, input scales are keyed by name */
+    std::vector<float> outputScale;
+    std::map<std::string, float> inputScale;
+public:
+    QuantizedMLP(){}
+    QuantizedMLP(const TNet &net, const InputVec &calibration)
+    {
+        topologySequence = net.topologySequence;
+        previous = net.previous;
+        int N = net.vertexs.size();
+        layers = std::vector<QLayer>(N);
+        names = std::vector<std::string>(N);
+        outputScale = std::vector<float>(N, 1);
+        /* calibrate activation ranges */
+        std::vector<T> outputMax(N, 0);
+        std::map<std::string, T> inputMax;
+        State state;
+        for (const Input &x : calibration) {
+            for (auto &in : x) {
+                T m = ML::maxAbs(in.second);
+                if (m > inputMax[in.first]) {
+                    inputMax[in.first] = m;
+                }
+            }
+            net.feedForward(x, state);
+            for (int i = 0; i < N; i++) {
+                T m = ML::maxAbs(state[i]);
+                outputMax[i] = m > outputMax[i] ? m : outputMax[i];
+            }
+        }
+        for (auto &m : inputMax) {
+            inputScale[m.first] = QMat::scaleOf(m.second);
+        }
+        for (int i = 0; i < N; i++) {
+            outputScale[i] = QMat::scaleOf(outputMax[i]);
+        }
+        /* quantize weights */
+        for (int i = 0; i < N; i++) {
+            const auto &layer = net.getObject(i);
+            names[i] = net.vertexs[i].name;
+            layers[i].layerType = layer.layerType;
+            layers[i].lossType = layer.lossType;
+            layers[i].B = layer.B;
+            for (auto &w : layer.W) {
+                layers[i].W.push_back(QMat::from(w, QMat::scaleOf(ML::maxAbs(w))));
+            }
+        }
+    }
+
+    void feedForward(const Input &x, State &O) const
+    {
+        int N = layers.size();
+        O.resize(N);
+        /* quantized outputs, one sample per row */
+        std::vector<QMat> q(N);
+        for (int current : topologySequence) {
+            const QLayer &layer = layers[current];
+            Mat<T> s;
+            if (layer.layerType == INPUT) {
+                const Mat<T> &xi = x.at(names[current]);
+                s = Mat<T>(layer.B.rows, xi.cols);
+                QMat xt = QMat::fromColumns(xi, inputScale.at(names[current]));
+                ML::qgemm(layer.W[0], xt, s);
+            } else if (layer.layerType == EMBEDDING) {
+                /* gather and dequantize the table rows of the ids */
+                const Mat<T> &xi = x.at(names[current]);
+                const QMat &table = layer.W[0];
+                s = Mat<T>(layer.B.rows, xi.cols);
+                for (int i = 0; i < xi.rows; i++) {
+                    for (int j = 0; j < xi.cols; j++) {
+                        int id = int(xi.data[i][j]);
+                        if (id < 0 || id >= table.rows) {
+                            continue;
+                        }
+                        const int8_t* w = table[id];
+                        for (int r = 0; r < s.rows; r++) {
+                            s.data[r][j] += T(table.scale) * T(w[r]);
+                        }
+                    }
+                }
+            } else {
+                const std::vector<int> &pre = previous[current];
+                for (std::size_t k = 0; k < pre.size(); k++) {
+                    if (s.isNull()) {
+                        s = Mat<T>(layer.B.rows, O[pre[k]].cols);
+                    }
+                    ML::qgemm(layer.W[k], q[pre[k]], s);
+                }
+            }
+            for (int i = 0; i < s.rows; i++) {
+                for (int j = 0; j < s.cols; j++) {
+                    s.data[i][j] += layer.B.data[i][0];
+                }
+            }
+            if (!O[current].isShapeEqual(s)) {
+                O[current].create(s.rows, s.cols);
+            }
+            if (!isInput(layer.layerType) && isSoftmax(layer.lossType)) {
+                softmax(s, O[current]);
+            } else {
+                O[current] = TNet::Activate::_(s);
+            }
+            q[current] = QMat::fromColumns(O[current], outputScale[current]);
+        }
+        return;
+    }
+
+    Mat<T> operator()(const Input &x) const
+    {
+        State state;
+        feedForward(x, state);
+        return state[topologySequence.back()];
+    }
+
+    size_t bytes() const
+    {
+        size_t n = 0;
+        for (auto &layer : layers) {
+            for (auto &w : layer.W) {
+                n += w.bytes();
+            }
+        }
+        return n;
+    }
+
+    /* accuracy of the int8 model against the original one */
+    Report compare(const TNet &net, const InputVec &samples) const
+    {
+        Report report;
+        report.sampleNum = samples.size();
+        report.maxError = 0;
+        report.meanError = 0;
+        report.argmaxAgreement = 0;
+        report.int8Bytes = bytes();
+        report.fp32Bytes = 0;
+        for (int i = 0; i < int(net.vertexs.size()); i++) {
+            for (auto &w : net.getObject(i).W) {
+                report.fp32Bytes += w.rows * w.cols * sizeof(float);
+            }
+        }
+        State state;
+        int count = 0;
+        for (const Input &x : samples) {
+            net.feedForward(x, state);
+            const Mat<T> &y0 = state[net.outputIndex()];
+            Mat<T> y = (*this)(x);
+            for (int i = 0; i < y.rows; i++) {
+                for (int j = 0; j < y.cols; j++) {
+                    double e = std::fabs(double(y.data[i][j] - y0.data[i][j]));
+                    report.maxError = e > report.maxError ? e : report.maxError;
+                    report.meanError += e;
+                    count++;
+                }
+            }
+            Pos p0 = ML::argmax(y0);
+            Pos p = ML::argmax(y);
+            report.argmaxAgreement += (p.i == p0.i && p.j == p0.j) ? 1 : 0;
+        }
+        if (count > 0) {
+            report.meanError /= count;
+        }
+        if (report.sampleNum > 0) {
+            report.argmaxAgreement /= report.sampleNum;
+        }
+        return report;
+    }
+};
+#endif // QUANTIZE_HPP
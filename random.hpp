@@ -0,0 +1,148 @@
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <atomic>
+
+namespace ML {
+
+/*
+    Philox4x32-10 counter based generator (Salmon et al., SC 2011).
+    a block of 4 words is a pure function of (key, counter), so element k of a fill
+    only depends on the seed and k: any split of the work over threads gives the same numbers
+*/
+class Philox
+{
+public:
+    uint32_t key[2];
+public:
+    explicit Philox(uint64_t seed = 0)
+    {
+        key[0] = uint32_t(seed);
+        key[1] = uint32_t(seed >> 32);
+    }
+    /* 4 random words of block counter */
+    inline void operator()(uint64_t counter, uint32_t x[4]) const
+    {
+        uint32_t c0 = uint32_t(counter);
+        uint32_t c1 = uint32_t(counter >> 32);
+        uint32_t c2 = 0;
+        uint32_t c3 = 0;
+        uint32_t k0 = key[0];
+        uint32_t k1 = key[1];
+        for (int r = 0; r < 10; r++) {
+            uint64_t p0 = uint64_t(0xD2511F53) * c0;
+            uint64_t p1 = uint64_t(0xCD9E8D57) * c2;
+            uint32_t t0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+            uint32_t t2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+            c1 = uint32_t(p1);
+            c3 = uint32_t(p0);
+            c0 = t0;
+            c2 = t2;
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        x[0] = c0;
+        x[1] = c1;
+        x[2] = c2;
+        x[3] = c3;
+        return;
+    }
+    /* (0, 1), never 0 so log is safe */
+    static inline double toUnit(uint32_t x)
+    {
+        return (double(x) + 0.5) * (1.0 / 4294967296.0);
+    }
+    /* element k of a stream is word k % 4 of block k / 4 */
+    inline uint32_t at(uint64_t k) const
+    {
+        uint32_t x[4];
+        (*this)(k >> 2, x);
+        return x[k & 3];
+    }
+    /* x[i] = element offset + i, uniform in (a, b) */
+    template<typename T>
+    void uniform(uint64_t offset, T *x, std::size_t n, double a, double b) const
+    {
+        uint32_t r[4];
+        double scale = b - a;
+        for (std::size_t i = 0; i < n;) {
+            uint64_t k = offset + i;
+            (*this)(k >> 2, r);
+            for (unsigned l = k & 3; l < 4 && i < n; l++, i++) {
+                x[i] = T(a + scale * toUnit(r[l]));
+            }
+        }
+        return;
+    }
+    /* x[i] = element offset + i, normal by Box-Muller on the word pairs (0, 1) and (2, 3) */
+    template<typename T>
+    void normal(uint64_t offset, T *x, std::size_t n, double mean, double stddev) const
+    {
+        const double pi2 = 6.283185307179586;
+        uint32_t r[4];
+        for (std::size_t i = 0; i < n;) {
+            uint64_t k = offset + i;
+            (*this)(k >> 2, r);
+            double z[4];
+            for (int l = 0; l < 4; l += 2) {
+                double radius = std::sqrt(-2 * std::log(toUnit(r[l])));
+                double theta = pi2 * toUnit(r[l + 1]);
+                z[l] = radius * std::cos(theta);
+                z[l + 1] = radius * std::sin(theta);
+            }
+            for (unsigned l = k & 3; l < 4 && i < n; l++, i++) {
+                x[i] = T(mean + stddev * z[l]);
+            }
+        }
+        return;
+    }
+};
+
+/*
+    process wide stream: a seed and an element counter.
+    every fill reserves a range of the counter, so fills are reproducible
+    from seed() in program order whatever the thread count inside each fill
+*/
+class Random
+{
+public:
+    static void seed(uint64_t s)
+    {
+        engineRef() = Philox(s);
+        counterRef() = 0;
+        return;
+    }
+    static Philox engine() {return engineRef();}
+    /* first element of n reserved elements */
+    static uint64_t reserve(uint64_t n)
+    {
+        /* keep ranges block aligned so a fill never shares a block with another */
+        return counterRef().fetch_add((n + 3) & ~uint64_t(3));
+    }
+    /* uniform in (0, 1) */
+    static double unit()
+    {
+        return Philox::toUnit(engineRef().at(reserve(1)));
+    }
+    /* uniform integer in [0, n) */
+    static int uniform(int n)
+    {
+        return int(unit() * n);
+    }
+protected:
+    static Philox& engineRef()
+    {
+        static Philox e;
+        return e;
+    }
+    static std::atomic<uint64_t>& counterRef()
+    {
+        static std::atomic<uint64_t> counter(0);
+        return counter;
+    }
+};
+
+}
+#endif // RANDOM_HPP
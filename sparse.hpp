@@ -0,0 +1,253 @@
+#ifndef SPARSE_HPP
+#define SPARSE_HPP
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "matrix.hpp"
+
+namespace ML {
+
+enum SparseFormat {
+    CSR = 0,
+    CSC
+};
+
+/*
+    compressed sparse matrix
+    CSR: offsets has rows + 1 entries, indices are column indexes
+    CSC: offsets has cols + 1 entries, indices are row indexes
+*/
+template<typename T>
+class SparseMat
+{
+public:
+    int rows;
+    int cols;
+    SparseFormat format;
+    std::vector<int> offsets;
+    std::vector<int> indices;
+    std::vector<T> values;
+public:
+    SparseMat():rows(0), cols(0), format(CSR){}
+    SparseMat(int rows_, int cols_, SparseFormat format_ = CSR):
+        rows(rows_), cols(cols_), format(format_),
+        offsets((format_ == CSR ? rows_ : cols_) + 1, 0){}
+    inline int nnz() const {return values.size();}
+    inline bool isNull() const {return rows == 0 || cols == 0;}
+    inline int majorSize() const {return format == CSR ? rows : cols;}
+
+    /* keep entries with |x| > threshold */
+    static SparseMat fromDense(const Mat<T> &x, SparseFormat format = CSR, T threshold = 0)
+    {
+        SparseMat y(x.rows, x.cols, format);
+        int major = y.majorSize();
+        int minor = format == CSR ? x.cols : x.rows;
+        for (int i = 0; i < major; i++) {
+            for (int j = 0; j < minor; j++) {
+                T v = format == CSR ? x.data[i][j] : x.data[j][i];
+                if (std::abs(v) > threshold) {
+                    y.indices.push_back(j);
+                    y.values.push_back(v);
+                }
+            }
+            y.offsets[i + 1] = y.indices.size();
+        }
+        return y;
+    }
+
+    Mat<T> toDense() const
+    {
+        Mat<T> y(rows, cols);
+        for (int i = 0; i < majorSize(); i++) {
+            for (int p = offsets[i]; p < offsets[i + 1]; p++) {
+                if (format == CSR) {
+                    y.data[i][indices[p]] = values[p];
+                } else {
+                    y.data[indices[p]][i] = values[p];
+                }
+            }
+        }
+        return y;
+    }
+
+    /* the CSR of x^T is the CSC of x: the arrays are copied as they are, nothing is reordered */
+    SparseMat Tr() const
+    {
+        SparseMat y(*this);
+        y.rows = cols;
+        y.cols = rows;
+        y.format = format == CSR ? CSC : CSR;
+        return y;
+    }
+
+    /* change storage format, O(nnz) */
+    SparseMat convert(SparseFormat dstFormat) const
+    {
+        if (dstFormat == format) {
+            return *this;
+        }
+        SparseMat y(rows, cols, dstFormat);
+        int major = y.majorSize();
+        y.indices = std::vector<int>(nnz());
+        y.values = std::vector<T>(nnz());
+        /* count */
+        for (int idx : indices) {
+            y.offsets[idx + 1]++;
+        }
+        for (int i = 0; i < major; i++) {
+            y.offsets[i + 1] += y.offsets[i];
+        }
+        /* scatter */
+        std::vector<int> pos(y.offsets.begin(), y.offsets.end() - 1);
+        for (int i = 0; i < majorSize(); i++) {
+            for (int p = offsets[i]; p < offsets[i + 1]; p++) {
+                int q = pos[indices[p]]++;
+                y.indices[q] = i;
+                y.values[q] = values[p];
+            }
+        }
+        return y;
+    }
+
+    /* refill values from a dense matrix, keeping the sparsity pattern */
+    void gather(const Mat<T> &x)
+    {
+        for (int i = 0; i < majorSize(); i++) {
+            for (int p = offsets[i]; p < offsets[i + 1]; p++) {
+                values[p] = format == CSR ? x.data[i][indices[p]] : x.data[indices[p]][i];
+            }
+        }
+        return;
+    }
+
+    void show() const
+    {
+        toDense().show();
+        return;
+    }
+};
+
+/* y = A * x */
+template<typename T>
+Mat<T> operator * (const SparseMat<T> &A, const Mat<T> &x)
+{
+    if (A.cols != x.rows) {
+        std::cout<<"sparse * size is not matched"<<std::endl;
+        return x;
+    }
+    Mat<T> y(A.rows, x.cols);
+    for (int i = 0; i < A.majorSize(); i++) {
+        for (int p = A.offsets[i]; p < A.offsets[i + 1]; p++) {
+            T v = A.values[p];
+            int r = A.format == CSR ? i : A.indices[p];
+            int k = A.format == CSR ? A.indices[p] : i;
+            std::vector<T> &yr = y.data[r];
+            const std::vector<T> &xk = x.data[k];
+            for (int j = 0; j < x.cols; j++) {
+                yr[j] += v * xk[j];
+            }
+        }
+    }
+    return y;
+}
+
+/* y = x * A */
+template<typename T>
+Mat<T> operator * (const Mat<T> &x, const SparseMat<T> &A)
+{
+    if (x.cols != A.rows) {
+        std::cout<<"* sparse size is not matched"<<std::endl;
+        return x;
+    }
+    Mat<T> y(x.rows, A.cols);
+    /* CSR: only the non-empty rows of A contribute, each row of x visits them and their entries, O(x.rows * (nonEmpty + nnz)) */
+    std::vector<int> nonEmpty;
+    if (A.format == CSR) {
+        for (int i = 0; i < A.majorSize(); i++) {
+            if (A.offsets[i] < A.offsets[i + 1]) {
+                nonEmpty.push_back(i);
+            }
+        }
+    }
+    for (int r = 0; r < x.rows; r++) {
+        const std::vector<T> &xr = x.data[r];
+        std::vector<T> &yr = y.data[r];
+        if (A.format == CSR) {
+            for (int i : nonEmpty) {
+                /* row i of A scaled by x[r][i] */
+                T xv = xr[i];
+                if (xv == 0) {
+                    continue;
+                }
+                for (int p = A.offsets[i]; p < A.offsets[i + 1]; p++) {
+                    yr[A.indices[p]] += xv * A.values[p];
+                }
+            }
+            continue;
+        }
+        /* CSC: column i of A dotted with row r of x */
+        for (int i = 0; i < A.majorSize(); i++) {
+            typename Accumulate<T>::type s = 0;
+            for (int p = A.offsets[i]; p < A.offsets[i + 1]; p++) {
+                s += xr[A.indices[p]] * A.values[p];
+            }
+            yr[i] += s;
+        }
+    }
+    return y;
+}
+
+/* dW += dy * x^T, only the columns of non-zero features are touched */
+template<typename T>
+void accumulateOuter(Mat<T> &dW, const Mat<T> &dy, const SparseMat<T> &x)
+{
+    if (dW.rows != dy.rows || dW.cols != x.rows || dy.cols != x.cols) {
+        std::cout<<"accumulateOuter size is not matched"<<std::endl;
+        return;
+    }
+    for (int i = 0; i < x.majorSize(); i++) {
+        for (int p = x.offsets[i]; p < x.offsets[i + 1]; p++) {
+            /* x[k][j] = v */
+            int k = x.format == CSR ? i : x.indices[p];
+            int j = x.format == CSR ? x.indices[p] : i;
+            T v = x.values[p];
+            for (int r = 0; r < dW.rows; r++) {
+                dW.data[r][k] += dy.data[r][j] * v;
+            }
+        }
+    }
+    return;
+}
+
+/* magnitude pruning: zero the smallest |w| so that a fraction of w is zero */
+template<typename T>
+SparseMat<T> prune(Mat<T> &W, double sparsity, SparseFormat format = CSR)
+{
+    std::vector<T> magnitude;
+    magnitude.reserve(W.rows * W.cols);
+    for (int i = 0; i < W.rows; i++) {
+        for (int j = 0; j < W.cols; j++) {
+            magnitude.push_back(std::abs(W.data[i][j]));
+        }
+    }
+    int k = int(sparsity * magnitude.size());
+    if (k > 0) {
+        k = k > int(magnitude.size()) ? magnitude.size() : k;
+        std::nth_element(magnitude.begin(), magnitude.begin() + k - 1, magnitude.end());
+        T threshold = magnitude[k - 1];
+        for (int i = 0; i < W.rows; i++) {
+            for (int j = 0; j < W.cols; j++) {
+                if (std::abs(W.data[i][j]) <= threshold) {
+                    W.data[i][j] = 0;
+                }
+            }
+        }
+    }
+    return SparseMat<T>::fromDense(W, format);
+}
+
+using SparseMatf = SparseMat<float>;
+using SparseMatd = SparseMat<double>;
+}
+#endif // SPARSE_HPP
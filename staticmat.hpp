@@ -0,0 +1,423 @@
+#ifndef STATICMAT_HPP
+#define STATICMAT_HPP
+#include <iostream>
+#include <cstdlib>
+#include "matrix.hpp"
+
+namespace ML {
+
+/* compile time loop: f(0), f(1), ..., f(N - 1) */
+template<int N>
+struct Unroll
+{
+    template<typename F>
+    inline static void _(F &f)
+    {
+        Unroll<N - 1>::_(f);
+        f(N - 1);
+    }
+};
+
+template<>
+struct Unroll<0>
+{
+    template<typename F>
+    inline static void _(F &){}
+};
+
+/*
+    fixed size matrix with inline storage, shapes are checked at compile time.
+    it has the same interface as Mat so small models can swap it in.
+*/
+template<typename T, int R, int C>
+class StaticMat
+{
+public:
+    static constexpr int rows = R;
+    static constexpr int cols = C;
+    T data[R][C];
+public:
+    StaticMat(){zero();}
+    StaticMat(int rows_, int cols_, MatType type = ZERO)
+    {
+        if (rows_ != R || cols_ != C) {
+            std::cout<<"static mat size is not matched"<<std::endl;
+        }
+        switch (type) {
+        case IDENTITY:
+            identity();
+            break;
+        case UNIFORM_RAND:
+            uniformRandom();
+            break;
+        case GAUSSIAN_RAND:
+            normalRandom();
+            break;
+        case XAVIER_RAND:
+            uniformRandom(-std::sqrt(6.0 / (R + C)), std::sqrt(6.0 / (R + C)));
+            break;
+        case HE_RAND:
+            normalRandom(0, std::sqrt(2.0 / C));
+            break;
+        default:
+            zero();
+            break;
+        }
+    }
+    explicit StaticMat(const Mat<T> &x)
+    {
+        if (x.rows != R || x.cols != C) {
+            std::cout<<"static mat size is not matched"<<std::endl;
+            zero();
+            return;
+        }
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] = x.data[i][j];
+            }
+        }
+    }
+    Mat<T> toMat() const
+    {
+        Mat<T> y(R, C);
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j];
+            }
+        }
+        return y;
+    }
+    inline constexpr bool isNull() const {return R == 0 || C == 0;}
+    inline constexpr bool isSquare() const {return R == C;}
+    inline T& at(int row, int col) {return data[row][col];}
+    inline const T& at(int row, int col) const {return data[row][col];}
+    inline T* operator[](int i) {return data[i];}
+    inline const T* operator[](int i) const {return data[i];}
+
+    void assign(T x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] = x;
+            }
+        }
+        return;
+    }
+    void zero(){assign(0);}
+    void identity()
+    {
+        if (!isSquare()) {
+            return;
+        }
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] = T(i == j);
+            }
+        }
+        return;
+    }
+    /* same stream as Mat, see Random */
+    void uniformRandom(double a = -1, double b = 1)
+    {
+        Random::engine().uniform(Random::reserve(R * C), &data[0][0], R * C, a, b);
+        return;
+    }
+    void normalRandom(double mean = 0, double stddev = 1)
+    {
+        Random::engine().normal(Random::reserve(R * C), &data[0][0], R * C, mean, stddev);
+        return;
+    }
+    void show() const
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                std::cout<<data[i][j]<<" ";
+            }
+            std::cout<<std::endl;
+        }
+        return;
+    }
+
+    /* (R, K) x (K, N) = (R, N), the inner product is unrolled */
+    template<int N>
+    StaticMat<T, R, N> operator * (const StaticMat<T, C, N> &x) const
+    {
+        StaticMat<T, R, N> y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < N; j++) {
+                typename Accumulate<T>::type s = 0;
+                auto dot = [&](int k){s += data[i][k] * x.data[k][j];};
+                Unroll<C>::_(dot);
+                y.data[i][j] = s;
+            }
+        }
+        return y;
+    }
+
+    StaticMat<T, C, R> Tr() const
+    {
+        StaticMat<T, C, R> y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[j][i] = data[i][j];
+            }
+        }
+        return y;
+    }
+
+    StaticMat operator + (const StaticMat &x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] + x.data[i][j];
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator += (const StaticMat &x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] += x.data[i][j];
+            }
+        }
+        return *this;
+    }
+
+    StaticMat operator + (T x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] + x;
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator += (T x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] += x;
+            }
+        }
+        return *this;
+    }
+
+    StaticMat operator - (const StaticMat &x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] - x.data[i][j];
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator -= (const StaticMat &x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] -= x.data[i][j];
+            }
+        }
+        return *this;
+    }
+
+    StaticMat operator - (T x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] - x;
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator -= (T x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] -= x;
+            }
+        }
+        return *this;
+    }
+
+    StaticMat operator / (const StaticMat &x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] / x.data[i][j];
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator /= (const StaticMat &x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] /= x.data[i][j];
+            }
+        }
+        return *this;
+    }
+
+    StaticMat operator / (T x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] / x;
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator /= (T x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] /= x;
+            }
+        }
+        return *this;
+    }
+
+    StaticMat operator % (const StaticMat &x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] * x.data[i][j];
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator %= (const StaticMat &x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] *= x.data[i][j];
+            }
+        }
+        return *this;
+    }
+
+    StaticMat operator * (T x) const
+    {
+        StaticMat y;
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                y.data[i][j] = data[i][j] * x;
+            }
+        }
+        return y;
+    }
+
+    StaticMat& operator *= (T x)
+    {
+        for (int i = 0; i < R; i++) {
+            for (int j = 0; j < C; j++) {
+                data[i][j] *= x;
+            }
+        }
+        return *this;
+    }
+};
+
+template<typename T, int R, int C>
+constexpr int StaticMat<T, R, C>::rows;
+template<typename T, int R, int C>
+constexpr int StaticMat<T, R, C>::cols;
+
+/* element (i, k) of op(x), op is folded at compile time */
+template<Operation op, typename T, int R, int C>
+inline const T& opAt(const StaticMat<T, R, C> &x, int i, int k)
+{
+    return op == NORMAL ? x.data[i][k] : x.data[k][i];
+}
+
+/*
+    C = alpha * op(A) * op(B) + beta * C. the operand forms are template arguments
+    so the shapes are checked at compile time, the inner product is unrolled
+*/
+template<Operation opA, Operation opB, typename T, int RA, int CA, int RB, int CB, int RC, int CC>
+void gemm(T alpha, const StaticMat<T, RA, CA> &A, const StaticMat<T, RB, CB> &B,
+          T beta, StaticMat<T, RC, CC> &C)
+{
+    using Acc = typename Accumulate<T>::type;
+    constexpr int p = opA == NORMAL ? CA : RA;
+    static_assert((opA == NORMAL ? RA : CA) == RC, "gemm rows of op(A) and C are not matched");
+    static_assert((opB == NORMAL ? RB : CB) == p, "gemm inner size is not matched");
+    static_assert((opB == NORMAL ? CB : RB) == CC, "gemm cols of op(B) and C are not matched");
+    for (int i = 0; i < RC; i++) {
+        for (int j = 0; j < CC; j++) {
+            Acc s = 0;
+            auto dot = [&](int k){s += Acc(opAt<opA>(A, i, k)) * Acc(opAt<opB>(B, k, j));};
+            Unroll<p>::_(dot);
+            C.data[i][j] = beta == T(0) ? Acc(alpha) * s : Acc(alpha) * s + Acc(beta) * Acc(C.data[i][j]);
+        }
+    }
+    return;
+}
+
+/* y = x1^T * x2 */
+template<typename T, int R, int C, int N>
+StaticMat<T, C, N> TrMul(const StaticMat<T, R, C> &x1, const StaticMat<T, R, N> &x2)
+{
+    StaticMat<T, C, N> y;
+    gemm<TRANSPOSE, NORMAL>(T(1), x1, x2, T(0), y);
+    return y;
+}
+
+/* y += x1 * x2^T */
+template<typename T, int R, int C, int K>
+void accumulateOuter(StaticMat<T, R, C> &y, const StaticMat<T, R, K> &x1, const StaticMat<T, C, K> &x2)
+{
+    return gemm<NORMAL, TRANSPOSE>(T(1), x1, x2, T(1), y);
+}
+
+/* sum of x^2, see sumSquares of Mat */
+template<typename T, int R, int C>
+T sumSquares(const StaticMat<T, R, C> &x, Summation method = PAIRWISE)
+{
+    using A = typename Accumulate<T>::type;
+    return T(sumOf<A>(&x.data[0][0], R * C, [](A v){return v * v;}, method));
+}
+
+template<typename T, int R, int C, typename F>
+StaticMat<T, R, C> for_each(const StaticMat<T, R, C> &x, F func)
+{
+    using A = typename Accumulate<T>::type;
+    StaticMat<T, R, C> y;
+    for (int i = 0; i < R; i++) {
+        for (int j = 0; j < C; j++) {
+            y.data[i][j] = T(func(A(x.data[i][j])));
+        }
+    }
+    return y;
+}
+
+template <typename T, int R, int C>
+StaticMat<T, R, C> SQRT(const StaticMat<T, R, C> &x)
+{
+    return for_each(x, [](typename Accumulate<T>::type v){return std::sqrt(v);});
+}
+
+template <typename T, int R, int C>
+StaticMat<T, R, C> EXP(const StaticMat<T, R, C> &x)
+{
+    return for_each(x, [](typename Accumulate<T>::type v){return std::exp(v);});
+}
+
+}
+#endif // STATICMAT_HPP
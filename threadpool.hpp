@@ -0,0 +1,110 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <exception>
+
+class ThreadPool
+{
+protected:
+    bool running;
+    std::mutex mutex;
+    std::condition_variable condit;
+    std::queue<std::function<void()> > tasks;
+    std::vector<std::thread> workers;
+public:
+    explicit ThreadPool(int threadNum = std::thread::hardware_concurrency()):running(true)
+    {
+        threadNum = threadNum < 1 ? 1 : threadNum;
+        for (int i = 0; i < threadNum; i++) {
+            workers.push_back(std::thread(&ThreadPool::run, this));
+        }
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> locker(mutex);
+            running = false;
+        }
+        condit.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool& operator = (const ThreadPool &) = delete;
+    inline int size() const {return workers.size();}
+
+    template<typename F>
+    std::future<void> submit(F func)
+    {
+        auto task = std::make_shared<std::packaged_task<void()> >(func);
+        std::future<void> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> locker(mutex);
+            tasks.push([task]{(*task)();});
+        }
+        condit.notify_one();
+        return result;
+    }
+
+    /*
+        func(i) for i in [0, n), the caller runs one share and waits for the rest.
+        the tasks hold a reference to func, so every task is waited for before
+        the first exception is rethrown
+    */
+    template<typename F>
+    void parallelFor(int n, F func)
+    {
+        if (n <= 0) {
+            return;
+        }
+        std::vector<std::future<void> > results;
+        for (int i = 1; i < n; i++) {
+            results.push_back(submit([&func, i]{func(i);}));
+        }
+        std::exception_ptr error;
+        try {
+            func(0);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        for (auto &result : results) {
+            try {
+                result.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return;
+    }
+protected:
+    void run()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> locker(mutex);
+                condit.wait(locker, [this]{return !running || !tasks.empty();});
+                if (!running && tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+};
+#endif // THREADPOOL_HPP